@@ -2,13 +2,33 @@
 
 #include "application_layer.h"
 
+#include "file_hash.h"
+#include "fountain.h"
+#include "journal.h"
 #include "link_layer.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "utils.h"
 
+// One-way links: the file goes out as fountain symbols, FOUNTAIN_REDUNDANCY
+// (a fraction of the k symbols of the file) plus FOUNTAIN_EXTRA_SYMBOLS more
+// than the k a perfect line would need. The receiver rebuilds the file from
+// the first k + 2 or so that arrive, so this is the loss rate it survives.
+// Symbols fill the largest payload the link takes.
+#define FOUNTAIN_REDUNDANCY 0.5
+#define FOUNTAIN_EXTRA_SYMBOLS 20
+
+// Each end keeps the journal of a transfer next to its file, named after it
+// with this appended, and removes it once the transfer is done. Only the
+// receiver's records how much of the file is there; the transmitter's only
+// says a transfer of its file was cut short.
+#define JOURNAL_SUFFIX ".journal"
+
 // TX AUX FUNCTIONS
                     
 FILE * openFile(const char *filename) 
@@ -24,18 +44,30 @@ long getFileSize(FILE * file)
     return size;
 }
 
+// Append a field of length bytes (least significant first, like T_SIZE)
+int appendField(unsigned char *packet, int i, unsigned char type, int length, uint64_t value)
+{
+    packet[i++] = type;
+    packet[i++] = length;
+    for(int j = 0; j < length; j++) packet[i++] = (value >> (8 * j)) & 0xFF;
+    return i;
+}
+
+// Bytes a size or offset field takes for value
+int fieldLength(uint64_t value)
+{
+    int length = SIZE_FIELD_LENGTH;
+    while(length < MAX_SIZE_FIELD_LENGTH && (value >> (8 * length)) != 0) length++;
+    return length;
+}
+
 int buildCtrlPck(unsigned char* packet, const char *filename, long file_size, int start)
 {
     int i = 0;
     int length = strlen(filename);
     
     packet[i++] = start ? C_START : C_END;
-    packet[i++] = T_SIZE; 
-    packet[i++] = SIZE_FIELD_LENGTH; 
-    packet[i++] = file_size & 0xFF;
-    packet[i++] = (file_size >> 8) & 0xFF;
-    packet[i++] = (file_size >> 16) & 0xFF;
-    packet[i++] = (file_size >> 24) & 0xFF;
+    i = appendField(packet, i, T_SIZE, fieldLength(file_size), file_size);
     packet[i++] = T_NAME;
     packet[i++] = length;
     
@@ -65,6 +97,22 @@ int buildDataPck(unsigned char* packet, unsigned char *buffer, int buffer_size)
     return i;
 }
 
+// Data packet for the receivers that take offsets: they write it where it
+// goes, and notice when data is missing or came twice
+int buildDataAtPck(unsigned char *packet, long offset, unsigned char *buffer, int buffer_size)
+{
+    int i = 0;
+
+    packet[i++] = C_DATA_AT;
+    for(int j = 0; j < 8; j++) packet[i++] = ((uint64_t)offset >> (8 * j)) & 0xFF;
+    packet[i++] = (buffer_size >> 8) & 0xFF;
+    packet[i++] = buffer_size & 0xFF;
+
+    memcpy(&packet[i], buffer, buffer_size);
+
+    return i + buffer_size;
+}
+
 int readFragFile(FILE * file, unsigned char *buffer, int maxSize)
 {
     int nBytes = fread(buffer, 1, maxSize, file);
@@ -74,41 +122,202 @@ int readFragFile(FILE * file, unsigned char *buffer, int maxSize)
     return nBytes;
 }
 
-// RX AUX FUNCTIONS
+int buildSymbolPck(unsigned char *packet, long file_size, uint32_t id)
+{
+    int i = 0;
+
+    packet[i++] = C_SYMBOL;
+    packet[i++] = file_size & 0xFF;
+    packet[i++] = (file_size >> 8) & 0xFF;
+    packet[i++] = (file_size >> 16) & 0xFF;
+    packet[i++] = (file_size >> 24) & 0xFF;
+    packet[i++] = id & 0xFF;
+    packet[i++] = (id >> 8) & 0xFF;
+    packet[i++] = (id >> 16) & 0xFF;
+    packet[i++] = (id >> 24) & 0xFF;
+
+    return i;
+}
 
-FILE * createFile(const char *filename)
+// Send the whole file as a stream of fountain symbols, nothing coming back
+int sendFountain(FILE *file, long file_size)
 {
-    return fopen(filename, "a");
+    int symbol_size = llmaxPayload() - SYMBOL_HEADER_SIZE;
+    int k = fountainSymbolCount(file_size, symbol_size);
+    long count = k + (long)(k * FOUNTAIN_REDUNDANCY) + FOUNTAIN_EXTRA_SYMBOLS;
+    Fountain fountain;
+    int result = 0;
+
+    unsigned char *source = calloc(k, symbol_size);
+    unsigned char *packet = malloc(SYMBOL_HEADER_SIZE + symbol_size);
+    if(!source || !packet || fread(source, 1, file_size, file) != (size_t)file_size || fountainInit(&fountain, k, symbol_size, FALSE) < 0) {
+        fprintf(stderr, "[APP] Could not read the file into memory\n");
+        free(source);
+        free(packet);
+        return -1;
+    }
+
+    for(uint32_t id = 0; id < count; id++) {
+        int header_size = buildSymbolPck(packet, file_size, id);
+        fountainEncode(&fountain, source, id, &packet[header_size]);
+
+        if(llwrite(packet, header_size + symbol_size) < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    if(result == 0) printf("[APP] Sent %ld fountain symbols for a file of %d symbols\n", count, k);
+    fountainFree(&fountain);
+    free(source);
+    free(packet);
+    return result;
 }
 
-int writeFile(FILE* file, unsigned char *buffer, int size)
+// RX AUX FUNCTIONS
+
+// The received file is written with write(2) straight from the packets the
+// link layer hands over, without stdio buffering in between. What is there
+// past offset (all of it for a new transfer) goes.
+int createFile(const char *filename, long offset)
 {
-    if(fwrite(buffer, 1, size, file) != size) {
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if(fd < 0) return -1;
+    if(ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+        close(fd);
         return -1;
     }
+    return fd;
+}
+
+int writeFile(int fd, const unsigned char *buffer, int size)
+{
+    while(size > 0) {
+        ssize_t n = write(fd, buffer, size);
+        if(n < 0) return -1;
+        buffer += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int writeFileAt(int fd, const unsigned char *buffer, int size, long offset)
+{
+    while(size > 0) {
+        ssize_t n = pwrite(fd, buffer, size, offset);
+        if(n < 0) return -1;
+        buffer += n;
+        size -= n;
+        offset += n;
+    }
 
     return 0;
 }
 
-int extractCtrlPck(unsigned char *packet, char *filename, long *file_size)
+// Value of a field of length bytes (up to 8, least significant first)
+uint64_t readField(const unsigned char *field, int length)
+{
+    uint64_t value = 0;
+    for(int j = length - 1; j >= 0; j--) value = (value << 8) | field[j];
+    return value;
+}
+
+int extractCtrlPck(const unsigned char *packet, int packet_size, char *filename, long *file_size)
 {
-    if(packet[1] != T_SIZE) return -1;
-    *file_size = (long)(packet[3] | packet[4] << 8 | packet[5] << 16 | packet[6] << 24);
-    if(packet[7] != T_NAME) return -1;
-    int length = packet[8];
-    memcpy(filename, &packet[9], length);
+    if(packet_size < 3 || packet[1] != T_SIZE) return -1;
+    int size_length = packet[2];
+    if(size_length < 1 || size_length > MAX_SIZE_FIELD_LENGTH || 3 + size_length + 2 > packet_size) return -1;
+    uint64_t size = readField(&packet[3], size_length);
+    if(size > LONG_MAX) return -1;
+    *file_size = size;
+
+    int i = 3 + size_length;
+    if(packet[i] != T_NAME) return -1;
+    int length = packet[i + 1];
+    if(i + 2 + length > packet_size) return -1;
+    memcpy(filename, &packet[i + 2], length);
     filename[length] = '\0';
 
     return 0;
 }
 
-int extractDataPck(unsigned char *packet, unsigned char *buffer)
+// Find a field of this type (up to 8 bytes) in a control packet of
+// packet_size bytes.
+// Returns 0 or -1 if there is none.
+int extractField(const unsigned char *packet, int packet_size, unsigned char type, uint64_t *value)
 {
+    int i = 1;
+    while(i + 2 <= packet_size && i + 2 + packet[i + 1] <= packet_size) {
+        int length = packet[i + 1];
+        if(packet[i] == type && length >= 1 && length <= 8) {
+            *value = readField(&packet[i + 2], length);
+            return 0;
+        }
+        i += 2 + length;
+    }
+
+    return -1;
+}
+
+// Point *data at the data field of a packet of packet_size bytes.
+// Returns its size or -1 if the packet is shorter than its length field says.
+int extractDataPck(const unsigned char *packet, int packet_size, const unsigned char **data)
+{
+    if(packet_size < 3) return -1;
     int data_size = (packet[1] << 8) | packet[2];
-    memcpy(buffer, &packet[3], data_size);
+    if(data_size > packet_size - 3) return -1;
+    *data = &packet[3];
+    return data_size;
+}
+
+// Same for a C_DATA_AT packet, with its offset in the file in *offset
+int extractDataAtPck(const unsigned char *packet, int packet_size, long *offset, const unsigned char **data)
+{
+    if(packet_size < DATA_AT_HEADER_SIZE) return -1;
+    uint64_t at = readField(&packet[1], 8);
+    int data_size = (packet[9] << 8) | packet[10];
+    if(at > LONG_MAX || data_size > packet_size - DATA_AT_HEADER_SIZE) return -1;
+    *offset = at;
+    *data = &packet[DATA_AT_HEADER_SIZE];
     return data_size;
 }
 
+// Add a fountain symbol packet, setting up the decoder on the first one
+// (whose size gives the symbol size).
+// Returns TRUE once the file can be rebuilt, FALSE if not yet, -1 on error.
+int receiveSymbol(Fountain *fountain, const unsigned char *packet, int packet_size, long *file_size)
+{
+    int symbol_size = packet_size - SYMBOL_HEADER_SIZE;
+    if(symbol_size < 1 || (fountain->k > 0 && symbol_size != fountain->symbolSize)) return -1;
+
+    long size = (long)(packet[1] | packet[2] << 8 | packet[3] << 16 | (unsigned long)packet[4] << 24);
+    uint32_t id = packet[5] | packet[6] << 8 | packet[7] << 16 | (uint32_t)packet[8] << 24;
+
+    if(fountain->k == 0) {
+        if(fountainInit(fountain, fountainSymbolCount(size, symbol_size), symbol_size, TRUE) < 0) {
+            fprintf(stderr, "[APP] File too large to decode in memory\n");
+            return -1;
+        }
+        *file_size = size;
+    }
+    else if(size != *file_size) return -1;
+
+    return fountainDecode(fountain, id, &packet[SYMBOL_HEADER_SIZE]);
+}
+
+// Write the file the fountain rebuilt, without the padding of its last symbol
+int writeFountainFile(int fd, const Fountain *fountain, long file_size)
+{
+    for(int i = 0; i < fountain->k && file_size > 0; i++) {
+        int size = (file_size < fountain->symbolSize) ? file_size : fountain->symbolSize;
+        if(writeFile(fd, fountainSource(fountain, i), size) < 0) return -1;
+        file_size -= size;
+    }
+
+    return 0;
+}
+
 ////////////////////////////////////////////////
 // APPLICATIONLAYER
 ////////////////////////////////////////////////
@@ -119,109 +328,366 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,int
     ll.baudRate = baudRate;
     ll.nRetransmissions = nTries;
     ll.timeout = timeout;
+    ll.windowSize = DEFAULT_WINDOW_SIZE;
+    ll.arq = DEFAULT_ARQ;
+    ll.check = DEFAULT_CHECK;
+    ll.framing = DEFAULT_FRAMING;
+    ll.fec = DEFAULT_FEC;
+    ll.chaseCombining = DEFAULT_CHASE_COMBINING;
+    ll.ackEvery = DEFAULT_ACK_EVERY;
+    ll.ackDelayMs = DEFAULT_ACK_DELAY_MS;
+    ll.adaptiveFrameSize = DEFAULT_ADAPTIVE_FRAME_SIZE;
+    ll.maxPayload = DEFAULT_MAX_PAYLOAD;
+    ll.compression = DEFAULT_COMPRESSION;
+    ll.aggregation = DEFAULT_AGGREGATION;
+    ll.aggregationDelayMs = DEFAULT_AGGREGATION_DELAY_MS;
+    ll.simplex = DEFAULT_SIMPLEX;
+    ll.piggyback = DEFAULT_PIGGYBACK;
+    ll.outageTimeout = DEFAULT_OUTAGE_TIMEOUT;
     ll.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
-    FILE * file;
-    long file_size;
+    FILE * file = NULL;
+    int fd = -1;
+    long file_size = -1; // until START (or the first symbol) gives it
     unsigned char ctrl_packet[MAX_PAYLOAD_SIZE];
-    int ctrl_packet_size;
+    int ctrl_packet_size = 0;
     unsigned char data_packet[MAX_DATA_PACKET_SIZE];
     int data_packet_size;
     int nBytes;
-    unsigned char frag_buffer[MAX_PAYLOAD_SIZE];
-    unsigned char packet_rx[MAX_DATA_PACKET_SIZE];
+    unsigned char frag_buffer[MAX_DATA_PACKET_SIZE];
+    const unsigned char *packet_rx;
+    const unsigned char *data_rx;
     int end_reached = FALSE;
-    char filename_rx[256];
+    char filename_rx[256] = "";
     char end_filename[256];
     long end_size;
-    
-    // Open link
-    if (llopen(ll) < 0) {
-        fprintf(stderr, "[APP] Failed to open link layer\n");
-        return;
-    }
-    
-    printf("[APP] Link layer opened successfully\n");
+    Fountain fountain = {0};
+    int symbol_result;
+    Journal journal = {0};
+    int journal_open = FALSE;
+    char journal_path[512];
+    long resume_offset = 0;
+    int resume_asked = FALSE;
+    uint32_t prefix_hash;
+    uint64_t offset;
+    uint64_t hash;
+    FileHash file_hash;
+    int file_hash_running = FALSE;
+    uint64_t file_digest;
+    unsigned char answer[MAX_PIGGYBACK_SIZE];
+    int answer_size;
+    char answer_filename[256];
+    long answer_file_size;
+    int positioned = FALSE;
+    int data_header_size = 3;
+    long data_offset = 0;
+    long data_at;
+    long skip;
+    uint64_t value;
+    int failed = FALSE;
+
+    snprintf(journal_path, sizeof(journal_path), "%s%s", filename, JOURNAL_SUFFIX);
     
     if(ll.role == LlTx) {
-        
+
         file = openFile(filename);
 
         if(!file) {
             fprintf(stderr, "[APP] Could not open file \n");
             return;
         }
-        
+
         file_size = getFileSize(file);
-        
+
         ctrl_packet_size = buildCtrlPck(ctrl_packet, filename, file_size, TRUE); // TRUE for start packet
 
-        if(llwrite(ctrl_packet, ctrl_packet_size) < 0) {
-            fprintf(stderr, "[APP] Failed to write START control packet\n");
-        } else {
-            printf("[APP] START Control packet written succesfully\n");
+        // A transfer of this file was cut short: the receiver says in its
+        // UA how much of it it has
+        if(!ll.simplex) {
+            journal_open = (journalOpen(&journal, journal_path) == 0);
+            resume_asked = (journal_open && journalMatches(&journal, filename, file_size));
+        }
+    } else if(!ll.simplex) {
+
+        // How much of the file a transfer that was cut short left on disk,
+        // offered to the transmitter in the UA, along with taking offsets
+        journal_open = (journalOpen(&journal, journal_path) == 0);
+        fd = (journal_open && journal.name[0] != '\0') ? open(filename, O_RDONLY) : -1;
+        if(fd >= 0) {
+            resume_offset = journalVerify(&journal, fd);
+            close(fd);
+            fd = -1;
         }
+        ctrl_packet[0] = C_RESUME;
+        ctrl_packet_size = 1;
+        if(resume_offset > 0) {
+            ctrl_packet_size = buildCtrlPck(ctrl_packet, journal.name, journal.size, TRUE);
+            ctrl_packet[0] = C_RESUME;
+            ctrl_packet_size = appendField(ctrl_packet, ctrl_packet_size, T_OFFSET, fieldLength(resume_offset), resume_offset);
+        }
+        ctrl_packet_size = appendField(ctrl_packet, ctrl_packet_size, T_DATA_OFFSETS, 1, TRUE);
+    }
+
+    // Open link. The START packet goes with the SET, unless the transmitter
+    // has part of the file out already: then it first hears from the UA how
+    // much of it the receiver has.
+    if (llopenWith(ll, resume_asked ? NULL : ctrl_packet, resume_asked ? 0 : ctrl_packet_size) < 0) {
+        fprintf(stderr, "[APP] Failed to open link layer\n");
+        failed = TRUE;
+        goto cleanup;
+    }
+    
+    printf("[APP] Link layer opened successfully\n");
+    
+    if(ll.role == LlTx) {
+
+        // Receivers that say so in their UA get data packets with offsets
+        answer_size = llopenAnswer(answer);
+        positioned = (answer_size > 0 && answer[0] == C_RESUME && extractField(answer, answer_size, T_DATA_OFFSETS, &value) == 0 && value);
+        if(positioned) data_header_size = DATA_AT_HEADER_SIZE;
+
+        // Resume from what the receiver has, if it is part of this file;
+        // START then says from where, and the hash of that part, read back
+        // from the file, for the receiver to check
+        if(resume_asked) {
+            if(answer_size > 0 && answer[0] == C_RESUME && extractCtrlPck(answer, answer_size, answer_filename, &answer_file_size) == 0 &&
+               strcmp(answer_filename, filename) == 0 && answer_file_size == file_size &&
+               extractField(answer, answer_size, T_OFFSET, &offset) == 0 && offset <= (uint64_t)file_size &&
+               journalFileHash(fileno(file), offset, &prefix_hash) == 0) {
+                resume_offset = offset;
+            }
+
+            if(resume_offset > 0) {
+                ctrl_packet_size = appendField(ctrl_packet, ctrl_packet_size, T_OFFSET, fieldLength(resume_offset), resume_offset);
+                ctrl_packet_size = appendField(ctrl_packet, ctrl_packet_size, T_HASH, SIZE_FIELD_LENGTH, prefix_hash);
+                printf("[APP] Resuming from byte %ld of %ld\n", resume_offset, file_size);
+            }
+
+            if(llwrite(ctrl_packet, ctrl_packet_size) < 0) {
+                fprintf(stderr, "[APP] Failed to write START control packet\n");
+                failed = TRUE;
+                goto close_link;
+            }
+            fseek(file, resume_offset, SEEK_SET);
+        }
+        data_offset = resume_offset;
+
+        // One already there is left as it is, whatever the receiver has
+        if(journal_open && !resume_asked && journalStart(&journal, filename, file_size, 0) < 0) {
+            fprintf(stderr, "[APP] Could not write the journal, the transfer cannot be resumed\n");
+            journalClose(&journal, FALSE);
+            journal_open = FALSE;
+        }
+
+        // The hash covers the whole file, the part a resumed transfer
+        // skips included
+        if(!ll.simplex) file_hash_running = (fileHashStart(&file_hash, filename, resume_offset) == 0);
+
+        printf("[APP] START Control packet written succesfully\n");
         
-        nBytes = readFragFile(file, frag_buffer, MAX_PAYLOAD_SIZE);
+        if(ll.simplex) {
+            if(sendFountain(file, file_size) < 0) {
+                fprintf(stderr, "[APP] Failed to send the file as fountain symbols\n");
+                failed = TRUE;
+                goto close_link;
+            }
+            nBytes = 0;
+        } else {
+            nBytes = readFragFile(file, frag_buffer, llpayloadSize() - data_header_size);
+        }
 
         while(nBytes > 0) {
 
-            data_packet_size = buildDataPck(data_packet, frag_buffer, nBytes);
+            if(file_hash_running) fileHashUpdate(&file_hash, frag_buffer, nBytes);
+            data_packet_size = positioned ? buildDataAtPck(data_packet, data_offset, frag_buffer, nBytes) : buildDataPck(data_packet, frag_buffer, nBytes);
+            data_offset += nBytes;
 
             if (llwrite(data_packet, data_packet_size) < 0) {
                 fprintf(stderr, "[APP] Failed to write data packet\n");
-                return;
+                failed = TRUE;
+                goto close_link;
             } else {
                 printf("[APP] Data packet written succesfully\n");
             }
 
-            nBytes = readFragFile(file, frag_buffer, MAX_PAYLOAD_SIZE);
+            nBytes = readFragFile(file, frag_buffer, llpayloadSize() - data_header_size);
             
         }   
 
-        ctrl_packet_size = buildCtrlPck(ctrl_packet, filename, file_size, FALSE); // FALSE for end packet
-
-        if(llwrite(ctrl_packet, ctrl_packet_size) < 0) {
-            fprintf(stderr, "[APP] Failed to write END control packet\n");
-        } else {
-            printf("[APP] END Control packet written succesfully\n");
+        if(nBytes < 0) {
+            fprintf(stderr, "[APP] Could not read the file\n");
+            failed = TRUE;
+            goto close_link;
         }
+
+        ctrl_packet_size = buildCtrlPck(ctrl_packet, filename, file_size, FALSE); // FALSE for end packet (sent by llcloseWith)
+        if(file_hash_running && fileHashFinish(&file_hash, &file_digest) == 0)
+            ctrl_packet_size = appendField(ctrl_packet, ctrl_packet_size, T_FILE_HASH, HASH_FIELD_LENGTH, file_digest);
+        file_hash_running = FALSE;
         
     } else {
         
         while(!end_reached) {
 
-            ctrl_packet_size = llread(packet_rx);
+            ctrl_packet_size = llreadView(&packet_rx);
 
-            if(ctrl_packet_size <= 0) break;
+            if(ctrl_packet_size <= 0) {
+                fprintf(stderr, "[APP] Link closed before the END control packet\n");
+                failed = TRUE;
+                break;
+            }
 
             switch (packet_rx[0])
             {
                 case C_START:
-                    if(extractCtrlPck(packet_rx, filename_rx, &file_size) < 0) {
+                    // The transmitter started over (the link layer dropped
+                    // what was left of its last session): the file does too
+                    if(fd >= 0) {
+                        printf("[APP] START again, the transfer starts over\n");
+                        if(file_hash_running) fileHashFinish(&file_hash, &file_digest);
+                        file_hash_running = FALSE;
+                        close(fd);
+                        fd = -1;
+                    }
+
+                    if(extractCtrlPck(packet_rx, ctrl_packet_size, filename_rx, &file_size) < 0) {
                         fprintf(stderr, "[APP] Control packet is malformed\n");
-                        return;
+                        failed = TRUE;
+                        goto close_link;
+                    }
+
+                    // A resumed transfer: the part kept must be the one the
+                    // journal checked, and the same the transmitter has
+                    offset = 0;
+                    if(extractField(packet_rx, ctrl_packet_size, T_OFFSET, &offset) == 0) {
+                        if(!journal_open || !journalMatches(&journal, filename_rx, file_size) || (long)offset > resume_offset ||
+                           extractField(packet_rx, ctrl_packet_size, T_HASH, &hash) < 0 || hash != journalPrefixHash(&journal, offset)) {
+                            fprintf(stderr, "[APP] START resumes a transfer that does not match the journal\n");
+                            failed = TRUE;
+                            goto close_link;
+                        }
+                        printf("[APP] Resuming from byte %lu of %ld\n", offset, file_size);
                     }
                     
-                    file = createFile(filename);
+                    fd = createFile(filename, offset);
 
-                    if(!file) {
+                    if(fd < 0) {
                         fprintf(stderr, "[APP] Could not create file \n");
-                        return;
+                        failed = TRUE;
+                        goto close_link;
                     }
 
+                    if(journal_open && journalStart(&journal, filename_rx, file_size, offset) < 0) {
+                        fprintf(stderr, "[APP] Could not write the journal, the transfer cannot be resumed\n");
+                        journalClose(&journal, FALSE);
+                        journal_open = FALSE;
+                    }
+
+                    if(!ll.simplex && !file_hash_running) file_hash_running = (fileHashStart(&file_hash, filename, offset) == 0);
+                    data_offset = offset;
+
                     break;
 
                 case C_DATA:
-                    data_packet_size = extractDataPck(packet_rx, frag_buffer);
-                    if(writeFile(file, frag_buffer, data_packet_size) < 0) {
+                case C_DATA_AT:
+                    // Left over from before this session's START
+                    if(fd < 0) {
+                        fprintf(stderr, "[APP] Data packet before START, dropped\n");
+                        break;
+                    }
+
+                    // Plain data packets go right after the previous ones
+                    data_at = data_offset;
+                    if(packet_rx[0] == C_DATA) data_packet_size = extractDataPck(packet_rx, ctrl_packet_size, &data_rx);
+                    else data_packet_size = extractDataAtPck(packet_rx, ctrl_packet_size, &data_at, &data_rx);
+                    if(data_packet_size < 0 || data_at + data_packet_size > file_size) {
+                        fprintf(stderr, "[APP] Data packet is malformed\n");
+                        break;
+                    }
+
+                    // What came before goes; what is missing cannot be
+                    // written around, the file being journaled and hashed in
+                    // order, so the transfer stops there (to be resumed)
+                    if(data_at < data_offset) {
+                        skip = (data_offset - data_at < data_packet_size) ? data_offset - data_at : data_packet_size;
+                        if(skip == data_packet_size) {
+                            printf("[APP] Data packet at byte %ld received twice\n", data_at);
+                            break;
+                        }
+                        data_rx += skip;
+                        data_packet_size -= skip;
+                        data_at += skip;
+                    }
+                    if(data_at > data_offset) {
+                        fprintf(stderr, "[APP] Data from byte %ld to %ld is missing\n", data_offset, data_at);
+                        failed = TRUE;
+                        goto close_link;
+                    }
+
+                    if(writeFileAt(fd, data_rx, data_packet_size, data_at) < 0) {
                         fprintf(stderr, "[APP] File was not written\n");
-                        return;
+                        failed = TRUE;
+                        goto close_link;
+                    }
+                    data_offset += data_packet_size;
+                    if(file_hash_running) fileHashUpdate(&file_hash, data_rx, data_packet_size);
+                    if(journal_open && journalAdd(&journal, data_rx, data_packet_size, fd) < 0) {
+                        fprintf(stderr, "[APP] Could not write the journal, the transfer cannot be resumed\n");
+                        journalClose(&journal, FALSE);
+                        journal_open = FALSE;
                     }
                     break;
 
+                case C_SYMBOL:
+                    symbol_result = receiveSymbol(&fountain, packet_rx, ctrl_packet_size, &file_size);
+                    if(symbol_result < 0) {
+                        fprintf(stderr, "[APP] Symbol packet is malformed\n");
+                        break;
+                    }
+                    if(!symbol_result) break;
+
+                    if(fd < 0) fd = createFile(filename, 0);
+                    if(fd < 0 || writeFountainFile(fd, &fountain, file_size) < 0) {
+                        fprintf(stderr, "[APP] File was not written\n");
+                        failed = TRUE;
+                        goto close_link;
+                    }
+                    printf("[APP] File rebuilt from %d fountain symbols (the file has %d)\n", fountain.received, fountain.k);
+                    end_reached = true;
+                    break;
+
                 case C_END:
-                    if(extractCtrlPck(packet_rx, end_filename, &end_size) < 0 || strcmp(end_filename, filename_rx) != 0 || end_size != file_size) {
+                    if(ll.simplex) {
+                        fprintf(stderr, "[APP] END before the file could be rebuilt (%d fountain symbols received)\n", fountain.received);
+                        failed = TRUE;
+                    } else if(extractCtrlPck(packet_rx, ctrl_packet_size, end_filename, &end_size) < 0 || strcmp(end_filename, filename_rx) != 0 || end_size != file_size) {
                         fprintf(stderr, "[APP] END control packet does not match START\n");
+                        failed = TRUE;
+                    } else if(data_offset != file_size) {
+                        fprintf(stderr, "[APP] Data from byte %ld to the end (%ld) is missing\n", data_offset, file_size);
+                        failed = TRUE;
+                    } else {
+                        // Checked against the transmitter's hash, if it sent one
+                        if(file_hash_running && fileHashFinish(&file_hash, &file_digest) == 0 &&
+                           extractField(packet_rx, ctrl_packet_size, T_FILE_HASH, &hash) == 0) {
+                            if(hash != file_digest) {
+                                fprintf(stderr, "[APP] File hash does not match the transmitter's, the file is corrupt and was deleted\n");
+                                failed = TRUE;
+                            } else {
+                                printf("[APP] File hash checked (%016llx)\n", (unsigned long long)file_digest);
+                            }
+                        }
+                        file_hash_running = FALSE;
+
+                        // Done either way: a corrupt file is not one to resume
+                        // (its journal only vouches for what was written), so
+                        // it goes, and the next transfer starts from scratch
+                        if(failed) {
+                            close(fd);
+                            fd = -1;
+                            unlink(filename);
+                        }
+                        if(journal_open) journalClose(&journal, TRUE);
+                        journal_open = FALSE;
                     }
                     end_reached = true;
                     break;
@@ -231,8 +697,6 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,int
         
     }
     
-    fclose(file);
-    
     
     /*
     
@@ -308,8 +772,30 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,int
                         
             */
                        
-    // Close link
+    // Close link (the END packet goes with the DISC, unless the transfer
+    // failed)
+close_link:
     printf("[APP] Closing link...\n");
-    llclose();
+    if(ll.role == LlTx && !failed) {
+        if(llcloseWith(ctrl_packet, ctrl_packet_size) < 0) {
+            fprintf(stderr, "[APP] Failed to write END control packet\n");
+            failed = TRUE;
+        } else {
+            printf("[APP] END Control packet written succesfully\n");
+            if(journal_open) journalClose(&journal, TRUE);
+            journal_open = FALSE;
+        }
+    } else {
+        llclose();
+    }
     printf("[APP] Link closed\n");
+
+    // What is left of a transfer that did not finish (its journal is kept)
+cleanup:
+    if(file) fclose(file);
+    if(file_hash_running) fileHashFinish(&file_hash, &file_digest);
+    if(journal_open) journalClose(&journal, FALSE);
+    if(fd >= 0) close(fd);
+    fountainFree(&fountain);
+    if(failed) fprintf(stderr, "[APP] Transfer failed\n");
 }
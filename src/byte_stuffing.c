@@ -0,0 +1,491 @@
+// Byte stuffing / destuffing, with vectorized kernels on x86
+
+#include "byte_stuffing.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+////////////////////////////////////////////////
+// Byte Stuffing
+////////////////////////////////////////////////
+int bytestuffing(const unsigned char *data, size_t length, unsigned char *out, int outMax)
+{
+    unsigned char bcc2 = 0;
+    return bytestuffingBCC2(data, length, out, outMax, &bcc2);
+}
+
+////////////////////////////////////////////////
+// Byte Stuffing + BCC2
+////////////////////////////////////////////////
+
+// Scalar version, also used for the tail the vector kernels leave over.
+// Returns the output index after the stuffed bytes, or -1 if out is full.
+static int stuffScalar(const unsigned char *data, size_t length, unsigned char *out, int outidx, int outMax, unsigned char *bcc2)
+{
+    unsigned char bcc = *bcc2;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char byte = data[i];
+        bcc ^= byte;
+
+        if (outidx >= outMax - 1)
+        {
+            fprintf(stderr, "[bytestuffing] out of space\n");
+            return -1;
+        }
+
+        if (byte == FLAG || byte == ESC)
+        {
+            out[outidx++] = ESC;
+            out[outidx++] = (byte == FLAG) ? ESCAUX : ESCAUX2;
+        }
+        else
+        {
+            out[outidx++] = byte;
+        }
+    }
+    *bcc2 = bcc;
+    return outidx;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Copy one block whose FLAG/ESC positions are set in mask, escaping them
+static inline int stuffBlock(const unsigned char *block, int blockSize, unsigned int mask, unsigned char *out)
+{
+    int outidx = 0;
+    int start = 0;
+
+    while (mask)
+    {
+        int pos = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        memcpy(&out[outidx], &block[start], pos - start);
+        outidx += pos - start;
+        out[outidx++] = ESC;
+        out[outidx++] = (block[pos] == FLAG) ? ESCAUX : ESCAUX2;
+        start = pos + 1;
+    }
+    memcpy(&out[outidx], &block[start], blockSize - start);
+    return outidx + blockSize - start;
+}
+
+static inline unsigned char xorBytes(const unsigned char *bytes, int n)
+{
+    unsigned char x = 0;
+    for (int i = 0; i < n; i++) x ^= bytes[i];
+    return x;
+}
+
+__attribute__((target("sse2")))
+static int stuffSSE2(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2)
+{
+    const __m128i flag = _mm_set1_epi8((char)FLAG);
+    const __m128i esc = _mm_set1_epi8((char)ESC);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    int outidx = 0;
+
+    // A 16-byte block needs at most 32 bytes of output
+    for (; i + 16 <= length && outidx + 32 <= outMax; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+        acc = _mm_xor_si128(acc, v);
+
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask == 0)
+        {
+            _mm_storeu_si128((__m128i *)&out[outidx], v);
+            outidx += 16;
+        }
+        else outidx += stuffBlock(&data[i], 16, mask, &out[outidx]);
+    }
+
+    unsigned char lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    *bcc2 ^= xorBytes(lanes, 16);
+
+    return stuffScalar(&data[i], length - i, out, outidx, outMax, bcc2);
+}
+
+__attribute__((target("avx2")))
+static int stuffAVX2(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2)
+{
+    const __m256i flag = _mm256_set1_epi8((char)FLAG);
+    const __m256i esc = _mm256_set1_epi8((char)ESC);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    int outidx = 0;
+
+    // A 32-byte block needs at most 64 bytes of output
+    for (; i + 32 <= length && outidx + 64 <= outMax; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+        acc = _mm256_xor_si256(acc, v);
+
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc)));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256((__m256i *)&out[outidx], v);
+            outidx += 32;
+        }
+        else outidx += stuffBlock(&data[i], 32, mask, &out[outidx]);
+    }
+
+    unsigned char lanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    *bcc2 ^= xorBytes(lanes, 32);
+
+    return stuffScalar(&data[i], length - i, out, outidx, outMax, bcc2);
+}
+
+#endif // HAVE_X86_KERNELS
+
+static int stuffPortable(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2)
+{
+    return stuffScalar(data, length, out, 0, outMax, bcc2);
+}
+
+typedef int (*StuffKernel)(const unsigned char *, size_t, unsigned char *, int, unsigned char *);
+
+static StuffKernel pickStuffKernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return stuffAVX2;
+    if (__builtin_cpu_supports("sse2")) return stuffSSE2;
+#endif
+    return stuffPortable;
+}
+
+int bytestuffingBCC2(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2)
+{
+    static StuffKernel kernel = NULL;
+    if (kernel == NULL) kernel = pickStuffKernel();
+
+    return kernel(data, length, out, outMax, bcc2);
+}
+
+////////////////////////////////////////////////
+// Byte Destuffing + BCC2
+////////////////////////////////////////////////
+
+// Scalar version, also used for blocks holding a FLAG and for the tail.
+// Returns the number of input bytes consumed.
+static size_t destuffScalar(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state)
+{
+    int o = *outidx;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        unsigned char byte = data[i];
+        if (byte == FLAG) break;
+
+        if (byte == ESC && !state->escaped)
+        {
+            state->escaped = 1;
+            continue;
+        }
+
+        if (o >= outMax) break;
+
+        if (state->escaped)
+        {
+            state->escaped = 0;
+            if (byte == ESCAUX) byte = FLAG;
+            else if (byte == ESCAUX2) byte = ESC;
+            else
+            {
+                state->malformed = 1;
+                continue;
+            }
+        }
+
+        out[o++] = byte;
+        state->bcc ^= byte;
+    }
+
+    *outidx = o;
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Destuff one block (no FLAG in it, no ESC in its last byte) whose ESC
+// positions are set in mask. The caller XORs the raw block into the BCC;
+// an ESC pair adds ESC ^ ESCAUX where FLAG was meant (and ESC ^ ESCAUX2
+// where ESC was), both off by ESC ^ 0x20, which is corrected here.
+static inline int destuffBlock(const unsigned char *block, int blockSize, unsigned int mask, unsigned char *out, DestuffState *state)
+{
+    int outidx = 0;
+    int start = 0;
+
+    while (mask)
+    {
+        int pos = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (pos < start) continue; // second byte of an ESC ESC pair, already flagged
+
+        memcpy(&out[outidx], &block[start], pos - start);
+        outidx += pos - start;
+
+        unsigned char next = block[pos + 1];
+        if (next == ESCAUX) out[outidx++] = FLAG;
+        else if (next == ESCAUX2) out[outidx++] = ESC;
+        else state->malformed = 1;
+
+        state->bcc ^= ESC ^ 0x20;
+        start = pos + 2;
+    }
+    memcpy(&out[outidx], &block[start], blockSize - start);
+    return outidx + blockSize - start;
+}
+
+__attribute__((target("sse2")))
+static size_t destuffSSE2(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state)
+{
+    const __m128i flag = _mm_set1_epi8((char)FLAG);
+    const __m128i esc = _mm_set1_epi8((char)ESC);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    while (i + 16 <= length && *outidx + 16 <= outMax)
+    {
+        // Finish an escape left open by the previous block
+        if (state->escaped)
+        {
+            size_t used = destuffScalar(&data[i], 1, out, outidx, outMax, state);
+            if (used == 0) break;
+            i += used;
+            continue;
+        }
+
+        __m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+        unsigned int flags = _mm_movemask_epi8(_mm_cmpeq_epi8(v, flag));
+        unsigned int escapes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, esc));
+
+        if (flags || (escapes & 0x8000))
+        {
+            size_t used = destuffScalar(&data[i], 16, out, outidx, outMax, state);
+            i += used;
+            if (used < 16) break;
+            continue;
+        }
+
+        acc = _mm_xor_si128(acc, v);
+        if (escapes == 0)
+        {
+            _mm_storeu_si128((__m128i *)&out[*outidx], v);
+            *outidx += 16;
+        }
+        else *outidx += destuffBlock(&data[i], 16, escapes, &out[*outidx], state);
+        i += 16;
+    }
+
+    unsigned char lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    state->bcc ^= xorBytes(lanes, 16);
+
+    return i + destuffScalar(&data[i], length - i, out, outidx, outMax, state);
+}
+
+__attribute__((target("avx2")))
+static size_t destuffAVX2(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state)
+{
+    const __m256i flag = _mm256_set1_epi8((char)FLAG);
+    const __m256i esc = _mm256_set1_epi8((char)ESC);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i + 32 <= length && *outidx + 32 <= outMax)
+    {
+        // Finish an escape left open by the previous block
+        if (state->escaped)
+        {
+            size_t used = destuffScalar(&data[i], 1, out, outidx, outMax, state);
+            if (used == 0) break;
+            i += used;
+            continue;
+        }
+
+        __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+        unsigned int flags = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, flag));
+        unsigned int escapes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, esc));
+
+        if (flags || (escapes & 0x80000000u))
+        {
+            size_t used = destuffScalar(&data[i], 32, out, outidx, outMax, state);
+            i += used;
+            if (used < 32) break;
+            continue;
+        }
+
+        acc = _mm256_xor_si256(acc, v);
+        if (escapes == 0)
+        {
+            _mm256_storeu_si256((__m256i *)&out[*outidx], v);
+            *outidx += 32;
+        }
+        else *outidx += destuffBlock(&data[i], 32, escapes, &out[*outidx], state);
+        i += 32;
+    }
+
+    unsigned char lanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    state->bcc ^= xorBytes(lanes, 32);
+
+    return i + destuffScalar(&data[i], length - i, out, outidx, outMax, state);
+}
+
+#endif // HAVE_X86_KERNELS
+
+typedef size_t (*DestuffKernel)(const unsigned char *, size_t, unsigned char *, int *, int, DestuffState *);
+
+static DestuffKernel pickDestuffKernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return destuffAVX2;
+    if (__builtin_cpu_supports("sse2")) return destuffSSE2;
+#endif
+    return destuffScalar;
+}
+
+int destuffBCC2(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state)
+{
+    static DestuffKernel kernel = NULL;
+    if (kernel == NULL) kernel = pickDestuffKernel();
+
+    return (int)kernel(data, length, out, outidx, outMax, state);
+}
+
+////////////////////////////////////////////////
+// COBS
+////////////////////////////////////////////////
+#define COBS_BLOCK 254
+
+// XOR of n bytes, a word at a time
+static unsigned char xorRun(const unsigned char *bytes, size_t n)
+{
+    uint64_t acc = 0;
+    for (; n >= 8; bytes += 8, n -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        acc ^= word;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+
+    unsigned char x = (unsigned char)acc;
+    while (n--) x ^= *bytes++;
+    return x;
+}
+
+void cobsBegin(CobsEncoder *encoder, unsigned char *out, int outMax)
+{
+    encoder->out = out;
+    encoder->outMax = outMax;
+    encoder->codePos = 0;
+    encoder->size = 1;
+}
+
+static void cobsCloseBlock(CobsEncoder *encoder)
+{
+    encoder->out[encoder->codePos] = (encoder->size - encoder->codePos) ^ FLAG;
+    encoder->codePos = encoder->size++;
+}
+
+int cobsPut(CobsEncoder *encoder, const unsigned char *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t room = COBS_BLOCK - (encoder->size - encoder->codePos - 1);
+        size_t chunk = length < room ? length : room;
+        const unsigned char *flag = memchr(data, FLAG, chunk);
+        size_t run = flag ? (size_t)(flag - data) : chunk;
+
+        if (encoder->size + (int)run + 1 > encoder->outMax)
+        {
+            fprintf(stderr, "[cobs] out of space\n");
+            return -1;
+        }
+
+        memcpy(&encoder->out[encoder->size], data, run);
+        encoder->size += run;
+        data += run;
+        length -= run;
+
+        if (flag)
+        {
+            // The FLAG itself is implied by the end of the block
+            cobsCloseBlock(encoder);
+            data++;
+            length--;
+        }
+        else if (encoder->size - encoder->codePos - 1 == COBS_BLOCK)
+            cobsCloseBlock(encoder);
+    }
+    return 0;
+}
+
+int cobsEnd(CobsEncoder *encoder)
+{
+    encoder->out[encoder->codePos] = (encoder->size - encoder->codePos) ^ FLAG;
+    return encoder->size;
+}
+
+int cobsDecodeBCC2(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state)
+{
+    size_t i = 0;
+    int o = *outidx;
+
+    while (i < length && data[i] != FLAG)
+    {
+        if (state->cobsLeft == 0)
+        {
+            // A new block: only now is the previous block's FLAG known not to be the end
+            if (state->cobsFlag)
+            {
+                if (o >= outMax) break;
+                out[o++] = FLAG;
+                state->bcc ^= FLAG;
+            }
+
+            int code = data[i++] ^ FLAG;
+            state->cobsLeft = code - 1;
+            state->cobsFlag = (code != COBS_BLOCK + 1);
+            continue;
+        }
+
+        size_t run = length - i;
+        if (run > (size_t)state->cobsLeft) run = state->cobsLeft;
+        if (run > (size_t)(outMax - o)) run = outMax - o;
+        if (run == 0) break;
+
+        const unsigned char *flag = memchr(&data[i], FLAG, run);
+        if (flag) run = flag - &data[i];
+
+        memcpy(&out[o], &data[i], run);
+        state->bcc ^= xorRun(&data[i], run);
+        o += run;
+        i += run;
+        state->cobsLeft -= run;
+    }
+
+    // The frame ends in the middle of a block
+    if (i < length && data[i] == FLAG && state->cobsLeft > 0) state->malformed = 1;
+
+    *outidx = o;
+    return i;
+}
@@ -0,0 +1,59 @@
+// Byte stuffing header.
+
+#ifndef BYTE_STUFFING_H
+#define BYTE_STUFFING_H
+
+#include <stddef.h>
+
+// Stuff length bytes of data into out (FLAG -> ESC ESCAUX, ESC -> ESC ESCAUX2).
+// Returns the number of bytes written or -1 if more than outMax are needed.
+int bytestuffing(const unsigned char *data, size_t length, unsigned char *out, int outMax);
+
+// Same as bytestuffing(), XORing every data byte into *bcc2 on the way.
+// Uses an AVX2 or SSE2 kernel when the CPU has one (picked at runtime): runs
+// without FLAG/ESC are copied a vector at a time.
+int bytestuffingBCC2(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2);
+
+// Destuffing state of one frame, carried from one chunk of input to the next
+typedef struct
+{
+    int escaped;       // the last byte seen was an ESC
+    int malformed;     // an ESC was followed by something other than ESCAUX/ESCAUX2
+    unsigned char bcc; // XOR of every destuffed byte so far
+    int cobsLeft;      // COBS: data bytes left in the current block
+    int cobsFlag;      // COBS: the current block ends with an implied FLAG
+} DestuffState;
+
+// Undo byte stuffing of data into out[*outidx..outMax), XORing every
+// destuffed byte into state->bcc on the way. Stops at the first FLAG (not
+// consumed), at the end of data or when out is full.
+// Returns the number of input bytes consumed; *outidx is advanced.
+// Uses an AVX2 or SSE2 kernel when the CPU has one, like bytestuffingBCC2().
+int destuffBCC2(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state);
+
+// Consistent Overhead Byte Stuffing, with FLAG as the byte removed: each
+// block is a code byte (data bytes + 1, XORed with FLAG so that it is never
+// FLAG itself) and up to 254 bytes without FLAG; a code below 0xFF ^ FLAG
+// stands for a FLAG after its block, except at the end. Overhead is at most
+// 1 byte per 254, whatever the data.
+typedef struct
+{
+    unsigned char *out;
+    int size;
+    int outMax;
+    int codePos; // where the current block's code byte goes
+} CobsEncoder;
+
+void cobsBegin(CobsEncoder *encoder, unsigned char *out, int outMax);
+
+// Encode length more bytes. Returns 0, or -1 if more than outMax are needed.
+int cobsPut(CobsEncoder *encoder, const unsigned char *data, size_t length);
+
+// Close the last block. Returns the encoded size.
+int cobsEnd(CobsEncoder *encoder);
+
+// Decode COBS like destuffBCC2() undoes byte stuffing: same state, same stop
+// conditions (a FLAG inside a block marks the frame malformed).
+int cobsDecodeBCC2(const unsigned char *data, size_t length, unsigned char *out, int *outidx, int outMax, DestuffState *state);
+
+#endif
@@ -0,0 +1,104 @@
+// CRC-32C (Castagnoli), hardware or slicing-by-8
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reflected 0x1EDC6F41
+
+////////////////////////////////////////////////
+// Slicing-by-8
+////////////////////////////////////////////////
+static uint32_t table[8][256];
+
+static void buildTable()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+}
+
+static uint32_t crcSlicing8(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        data += 8;
+        length -= 8;
+    }
+
+    while (length--)
+        crc = table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+////////////////////////////////////////////////
+// SSE4.2
+////////////////////////////////////////////////
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.2")))
+static uint32_t crcSSE42(uint32_t crc, const unsigned char *data, size_t length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; length >= 4; data += 4, length -= 4)
+    {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+#endif // HAVE_X86_KERNELS
+
+typedef uint32_t (*CrcKernel)(uint32_t, const unsigned char *, size_t);
+
+static CrcKernel pickCrcKernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) return crcSSE42;
+#endif
+    buildTable();
+    return crcSlicing8;
+}
+
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t length)
+{
+    static CrcKernel kernel = NULL;
+    if (kernel == NULL) kernel = pickCrcKernel();
+
+    return ~kernel(~crc, data, length);
+}
@@ -0,0 +1,14 @@
+// CRC-32C header.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli) of length bytes of data, continuing from crc (0 to
+// start a new one). Uses the SSE4.2 crc32 instruction when the CPU has it
+// (picked at runtime), slicing-by-8 otherwise.
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t length);
+
+#endif
@@ -0,0 +1,125 @@
+// File hash, worked out on a thread of its own. The Makefile does not pass
+// -pthread: this links as is only where libpthread is part of libc (glibc
+// 2.34 and later); see README.txt for older ones.
+
+#include "file_hash.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PREFIX_READ_SIZE 65536
+
+static void hashPrefix(FileHash *hash)
+{
+    int fd = open(hash->path, O_RDONLY);
+    unsigned char *buf = malloc(PREFIX_READ_SIZE);
+    long done = 0;
+
+    while (fd >= 0 && buf && done < hash->prefix)
+    {
+        long size = hash->prefix - done;
+        if (size > PREFIX_READ_SIZE) size = PREFIX_READ_SIZE;
+        ssize_t n = pread(fd, buf, size, done);
+        if (n <= 0) break;
+        xxh64Update(&hash->state, buf, n);
+        done += n;
+    }
+
+    if (done < hash->prefix) hash->error = -1;
+    free(buf);
+    if (fd >= 0) close(fd);
+}
+
+static void *hashThread(void *arg)
+{
+    FileHash *hash = arg;
+    hashPrefix(hash);
+
+    pthread_mutex_lock(&hash->lock);
+    while (1)
+    {
+        while (hash->hashed == hash->added && !hash->finishing) pthread_cond_wait(&hash->changed, &hash->lock);
+        if (hash->hashed == hash->added) break;
+
+        // Up to what was added, or the end of the ring: the producer only
+        // writes past hashed, so this stretch stays put while unlocked
+        unsigned long start = hash->hashed % FILE_HASH_RING_SIZE;
+        unsigned long size = hash->added - hash->hashed;
+        if (size > FILE_HASH_RING_SIZE - start) size = FILE_HASH_RING_SIZE - start;
+        pthread_mutex_unlock(&hash->lock);
+
+        xxh64Update(&hash->state, &hash->ring[start], size);
+
+        pthread_mutex_lock(&hash->lock);
+        hash->hashed += size;
+        pthread_cond_broadcast(&hash->changed);
+    }
+    pthread_mutex_unlock(&hash->lock);
+    return NULL;
+}
+
+int fileHashStart(FileHash *hash, const char *path, long prefix)
+{
+    memset(hash, 0, sizeof(*hash));
+    if (prefix > 0 && strlen(path) >= sizeof(hash->path)) return -1;
+    if (prefix > 0) strcpy(hash->path, path);
+    hash->prefix = prefix;
+    xxh64Init(&hash->state, 0);
+
+    hash->ring = malloc(FILE_HASH_RING_SIZE);
+    if (!hash->ring) return -1;
+    pthread_mutex_init(&hash->lock, NULL);
+    pthread_cond_init(&hash->changed, NULL);
+    if (pthread_create(&hash->thread, NULL, hashThread, hash) != 0)
+    {
+        pthread_mutex_destroy(&hash->lock);
+        pthread_cond_destroy(&hash->changed);
+        free(hash->ring);
+        return -1;
+    }
+    return 0;
+}
+
+void fileHashUpdate(FileHash *hash, const unsigned char *data, int size)
+{
+    pthread_mutex_lock(&hash->lock);
+    while (size > 0)
+    {
+        // Wait only if the thread is a whole ring behind
+        while (hash->added - hash->hashed == FILE_HASH_RING_SIZE) pthread_cond_wait(&hash->changed, &hash->lock);
+
+        unsigned long start = hash->added % FILE_HASH_RING_SIZE;
+        unsigned long room = FILE_HASH_RING_SIZE - (hash->added - hash->hashed);
+        if (room > FILE_HASH_RING_SIZE - start) room = FILE_HASH_RING_SIZE - start;
+        unsigned long take = ((unsigned long)size < room) ? (unsigned long)size : room;
+        pthread_mutex_unlock(&hash->lock);
+
+        memcpy(&hash->ring[start], data, take);
+        data += take;
+        size -= take;
+
+        pthread_mutex_lock(&hash->lock);
+        hash->added += take;
+        pthread_cond_broadcast(&hash->changed);
+    }
+    pthread_mutex_unlock(&hash->lock);
+}
+
+int fileHashFinish(FileHash *hash, uint64_t *result)
+{
+    pthread_mutex_lock(&hash->lock);
+    hash->finishing = 1;
+    pthread_cond_broadcast(&hash->changed);
+    pthread_mutex_unlock(&hash->lock);
+    pthread_join(hash->thread, NULL);
+
+    pthread_mutex_destroy(&hash->lock);
+    pthread_cond_destroy(&hash->changed);
+    free(hash->ring);
+    hash->ring = NULL;
+
+    *result = xxh64Digest(&hash->state);
+    return hash->error;
+}
@@ -0,0 +1,44 @@
+// File hash header.
+
+#ifndef FILE_HASH_H
+#define FILE_HASH_H
+
+#include "xxhash.h"
+
+#include <pthread.h>
+
+// Bytes the hashing thread can fall behind by before fileHashUpdate() waits
+#define FILE_HASH_RING_SIZE (1 << 20)
+
+// XXH64 of a file as it goes through, worked out by a thread of its own on
+// copies of the pieces handed to it, so the frame path only pays for a
+// memcpy. The thread can start with a prefix of the file already on disk
+// (a resumed transfer), read back from it.
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned char *ring;
+    unsigned long added;   // bytes handed over
+    unsigned long hashed;  // bytes the thread is done with
+    int finishing;
+    int error;             // -1 if the prefix could not be read
+    char path[512];
+    long prefix;
+    Xxh64 state;
+} FileHash;
+
+// Start the thread, hashing the first prefix bytes of the file at path
+// (none for a new transfer) before what fileHashUpdate() hands it.
+// Returns 0 or -1 on error.
+int fileHashStart(FileHash *hash, const char *path, long prefix);
+
+// Hand over the next size bytes of the file (copied)
+void fileHashUpdate(FileHash *hash, const unsigned char *data, int size);
+
+// Wait for the thread to hash everything and stop it.
+// Returns 0 and the hash in *result, or -1 if the prefix could not be read.
+int fileHashFinish(FileHash *hash, uint64_t *result);
+
+#endif
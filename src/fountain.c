@@ -0,0 +1,263 @@
+// LT fountain code, decoded by Gaussian elimination
+
+#include "fountain.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Robust soliton parameters: c scales the extra low degrees and the spike
+// at k/R, delta bounds the probability that k(1 + small) symbols fail
+#define LT_C 0.1
+#define LT_DELTA 0.5
+
+#define LN2 0.69314718055994530942
+
+////////////////////////////////////////////////
+// Degree distribution
+////////////////////////////////////////////////
+
+// Natural logarithm and square root, only used to set up the distribution
+// (not worth linking libm for)
+static double naturalLog(double x)
+{
+    double result = 0;
+    while (x > 2)
+    {
+        x /= 2;
+        result += LN2;
+    }
+    while (x < 1)
+    {
+        x *= 2;
+        result -= LN2;
+    }
+
+    // ln x = 2 atanh((x - 1) / (x + 1)), with |y| <= 1/3
+    double y = (x - 1) / (x + 1), term = y;
+    for (int i = 1; i < 40; i += 2)
+    {
+        result += 2 * term / i;
+        term *= y * y;
+    }
+    return result;
+}
+
+static double squareRoot(double x)
+{
+    double root = (x > 1) ? x : 1;
+    for (int i = 0; i < 64; i++)
+        root = (root + x / root) / 2;
+    return root;
+}
+
+// Robust soliton: the ideal soliton (1/k for degree 1, 1/(d(d-1)) above)
+// plus R/(dk) below k/R and a spike at k/R, normalised.
+// Gaussian elimination has no use for the low degrees peeling needs; what
+// it stalls on is a source symbol that no symbol covers yet. Drawn degrees
+// are raised to 2 ln k (k/2 at most), which brings the symbols needed down
+// to about k + 2.
+static void buildDegrees(Fountain *fountain)
+{
+    int k = fountain->k;
+    fountain->minDegree = (int)(2 * naturalLog(k)) + 1;
+    if (fountain->minDegree > k / 2) fountain->minDegree = k / 2;
+
+    double R = LT_C * naturalLog(k / LT_DELTA) * squareRoot(k);
+    int spike = (int)(k / R + 0.5);
+    if (spike < 1) spike = 1;
+    if (spike > k) spike = k;
+
+    double total = 0;
+    for (int d = 1; d <= k; d++)
+    {
+        double p = (d == 1) ? 1.0 / k : 1.0 / ((double)d * (d - 1));
+        if (d < spike) p += R / ((double)d * k);
+        else if (d == spike) p += R * naturalLog(R / LT_DELTA) / k;
+        if (p < 0) p = 0;
+
+        total += p;
+        fountain->degrees[d] = total;
+    }
+    for (int d = 1; d <= k; d++)
+        fountain->degrees[d] /= total;
+}
+
+////////////////////////////////////////////////
+// Symbols
+////////////////////////////////////////////////
+
+// splitmix64: the same sequence on both sides for the same id
+static uint64_t nextRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Fill fountain->row with the source symbols of symbol id
+static void sourcesOf(Fountain *fountain, uint32_t id)
+{
+    int k = fountain->k;
+    uint64_t state = ((uint64_t)k << 32) | id;
+    memset(fountain->row, 0, fountain->rowWords * sizeof(uint64_t));
+
+    // Degree: first d whose cumulative probability reaches u
+    double u = (nextRandom(&state) >> 11) * (1.0 / (1ull << 53));
+    int low = 1, high = k;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (fountain->degrees[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    if (low < fountain->minDegree) low = fountain->minDegree;
+
+    for (int chosen = 0; chosen < low;)
+    {
+        int i = nextRandom(&state) % k;
+        uint64_t bit = 1ull << (i % 64);
+        if (fountain->row[i / 64] & bit) continue;
+        fountain->row[i / 64] |= bit;
+        chosen++;
+    }
+}
+
+int fountainSymbolCount(long size, int symbolSize)
+{
+    long k = (size + symbolSize - 1) / symbolSize;
+    return (k > 0) ? k : 1;
+}
+
+int fountainInit(Fountain *fountain, int k, int symbolSize, int decoder)
+{
+    memset(fountain, 0, sizeof(*fountain));
+    fountain->k = k;
+    fountain->symbolSize = symbolSize;
+    fountain->rowWords = (k + 63) / 64;
+    fountain->dataWords = (symbolSize + 7) / 8;
+
+    fountain->degrees = malloc((k + 1) * sizeof(double));
+    fountain->row = malloc(fountain->rowWords * sizeof(uint64_t));
+    if (!fountain->degrees || !fountain->row) goto failed;
+    buildDegrees(fountain);
+    if (!decoder) return 0;
+
+    // Row k is scratch for the symbol being added
+    fountain->rows = malloc((size_t)k * fountain->rowWords * sizeof(uint64_t));
+    fountain->data = malloc((size_t)(k + 1) * fountain->dataWords * sizeof(uint64_t));
+    fountain->present = calloc(k, 1);
+    if (fountain->rows && fountain->data && fountain->present) return 0;
+
+failed:
+    fountainFree(fountain);
+    return -1;
+}
+
+void fountainFree(Fountain *fountain)
+{
+    free(fountain->degrees);
+    free(fountain->row);
+    free(fountain->rows);
+    free(fountain->data);
+    free(fountain->present);
+    memset(fountain, 0, sizeof(*fountain));
+}
+
+void fountainEncode(Fountain *fountain, const unsigned char *source, uint32_t id, unsigned char *symbol)
+{
+    int size = fountain->symbolSize;
+    sourcesOf(fountain, id);
+    memset(symbol, 0, size);
+
+    for (int w = 0; w < fountain->rowWords; w++)
+    {
+        for (uint64_t bits = fountain->row[w]; bits; bits &= bits - 1)
+        {
+            const unsigned char *s = &source[(size_t)(w * 64 + __builtin_ctzll(bits)) * size];
+            for (int j = 0; j < size; j++)
+                symbol[j] ^= s[j];
+        }
+    }
+}
+
+////////////////////////////////////////////////
+// Decoder
+////////////////////////////////////////////////
+static uint64_t *rowOf(const Fountain *fountain, int c)
+{
+    return &fountain->rows[(size_t)c * fountain->rowWords];
+}
+
+static uint64_t *dataOf(const Fountain *fountain, int c)
+{
+    return &fountain->data[(size_t)c * fountain->dataWords];
+}
+
+static void xorWords(uint64_t *to, const uint64_t *from, int words)
+{
+    for (int w = 0; w < words; w++)
+        to[w] ^= from[w];
+}
+
+// Lowest column set in row from word w on, or -1
+static int lowestColumn(const uint64_t *row, int w, int words)
+{
+    for (; w < words; w++)
+    {
+        if (row[w]) return w * 64 + __builtin_ctzll(row[w]);
+    }
+    return -1;
+}
+
+// Full rank: going up from the last row, each row's symbol loses those of
+// the (already solved) columns after its own
+static void backSubstitute(Fountain *fountain)
+{
+    for (int c = fountain->k - 1; c >= 0; c--)
+    {
+        const uint64_t *row = rowOf(fountain, c);
+        for (int w = c / 64; w < fountain->rowWords; w++)
+        {
+            uint64_t bits = row[w];
+            if (w == c / 64) bits &= ~0ull << (c % 64) << 1;
+            for (; bits; bits &= bits - 1)
+                xorWords(dataOf(fountain, c), dataOf(fountain, w * 64 + __builtin_ctzll(bits)), fountain->dataWords);
+        }
+    }
+}
+
+int fountainDecode(Fountain *fountain, uint32_t id, const unsigned char *symbol)
+{
+    if (fountain->rank == fountain->k) return 1;
+    fountain->received++;
+
+    uint64_t *row = fountain->row;
+    uint64_t *data = dataOf(fountain, fountain->k);
+    sourcesOf(fountain, id);
+    data[fountain->dataWords - 1] = 0;
+    memcpy(data, symbol, fountain->symbolSize);
+
+    // Eliminate the columns that already have a row
+    int c = lowestColumn(row, 0, fountain->rowWords);
+    while (c >= 0 && fountain->present[c])
+    {
+        xorWords(&row[c / 64], &rowOf(fountain, c)[c / 64], fountain->rowWords - c / 64);
+        xorWords(data, dataOf(fountain, c), fountain->dataWords);
+        c = lowestColumn(row, c / 64, fountain->rowWords);
+    }
+    if (c < 0) return 0; // nothing new
+
+    memcpy(rowOf(fountain, c), row, fountain->rowWords * sizeof(uint64_t));
+    memcpy(dataOf(fountain, c), data, fountain->dataWords * sizeof(uint64_t));
+    fountain->present[c] = 1;
+
+    if (++fountain->rank < fountain->k) return 0;
+    backSubstitute(fountain);
+    return 1;
+}
+
+const unsigned char *fountainSource(const Fountain *fountain, int i)
+{
+    return (const unsigned char *)dataOf(fountain, i);
+}
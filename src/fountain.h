@@ -0,0 +1,51 @@
+// LT fountain code header.
+
+#ifndef FOUNTAIN_H
+#define FOUNTAIN_H
+
+#include <stdint.h>
+
+// A file is cut into k source symbols of symbolSize bytes, the last one zero
+// padded. Encoded symbol id is the XOR of some of them: how many follows the
+// robust soliton distribution and which ones are drawn at random, both from
+// a generator seeded with id. A symbol only needs its id to be decoded, the
+// stream has no end and any k or slightly more symbols rebuild the file.
+typedef struct
+{
+    int k;
+    int symbolSize;
+    double *degrees;   // cumulative distribution of degrees 1..k
+    int minDegree;     // below which drawn degrees are raised
+    int rowWords;      // 64-bit words in a row of k bits
+    uint64_t *row;     // source symbols of the symbol being encoded or decoded
+    // Decoder: rows of a matrix kept in echelon form, row c (if present)
+    // having its lowest bit at column c, and the XOR of their symbols
+    uint64_t *rows;
+    uint64_t *data;
+    int dataWords;
+    unsigned char *present;
+    int rank;
+    int received;
+} Fountain;
+
+// Number of source symbols for a file of size bytes (at least 1)
+int fountainSymbolCount(long size, int symbolSize);
+
+// Set up a fountain of k symbols; decoder also allocates the decoding
+// matrix (k^2 bits). Returns 0 or -1 if out of memory.
+int fountainInit(Fountain *fountain, int k, int symbolSize, int decoder);
+
+void fountainFree(Fountain *fountain);
+
+// Write symbol id of the k * symbolSize bytes at source into symbol.
+void fountainEncode(Fountain *fountain, const unsigned char *source, uint32_t id, unsigned char *symbol);
+
+// Add symbol id to the decoder (Gaussian elimination on the fly: a symbol
+// whose source symbols are already known, or a combination of known ones,
+// is dropped). Returns TRUE once every source symbol is known.
+int fountainDecode(Fountain *fountain, uint32_t id, const unsigned char *symbol);
+
+// Source symbol i, once fountainDecode() has returned TRUE.
+const unsigned char *fountainSource(const Fountain *fountain, int i);
+
+#endif
@@ -0,0 +1,301 @@
+// Streaming frame parser: bytes in, typed frames out
+
+#include "frame_parser.h"
+#include "crc32c.h"
+#include "reed_solomon.h"
+
+#include <stdio.h>
+#include <string.h>
+
+////////////////////////////////////////////////
+// Tables
+////////////////////////////////////////////////
+
+// Byte classes
+enum
+{
+    BYTE_DATA,
+    BYTE_FLAG,
+    BYTE_ESC,
+    BYTE_CLASSES
+};
+
+static const unsigned char byteClass[256] = {
+    [FLAG] = BYTE_FLAG,
+    [ESC] = BYTE_ESC,
+};
+
+// Parser states: one per header field, then the information field
+enum
+{
+    ST_HUNT, // out of sync, looking for a FLAG
+    ST_ADDRESS,
+    ST_CONTROL,
+    ST_SEQUENCE, // N, extended control fields only
+    ST_BCC1,
+    ST_INFO,
+    ST_COUNT
+};
+
+// Actions
+enum
+{
+    ACT_SKIP,    // noise between frames
+    ACT_OPEN,    // FLAG: a frame starts (a runt before it is dropped)
+    ACT_ESCAPE,  // ESC in the header: the next byte is escaped
+    ACT_FIELD,   // header byte
+    ACT_CONTROL, // control byte: decides whether N follows
+    ACT_INFO,    // information field, destuffed in bulk up to the next FLAG
+    ACT_CLOSE,   // FLAG: the frame is complete
+};
+
+typedef struct
+{
+    unsigned char action;
+    unsigned char next;
+} Transition;
+
+#define T(action, next) {action, next}
+#define ROW(onData, onFlag, onEsc) {[BYTE_DATA] = onData, [BYTE_FLAG] = onFlag, [BYTE_ESC] = onEsc}
+
+static const Transition transitions[ST_COUNT][BYTE_CLASSES] = {
+    [ST_HUNT] = ROW(T(ACT_SKIP, ST_HUNT), T(ACT_OPEN, ST_ADDRESS), T(ACT_SKIP, ST_HUNT)),
+    [ST_ADDRESS] = ROW(T(ACT_FIELD, ST_CONTROL), T(ACT_OPEN, ST_ADDRESS), T(ACT_ESCAPE, ST_ADDRESS)),
+    [ST_CONTROL] = ROW(T(ACT_CONTROL, ST_BCC1), T(ACT_OPEN, ST_ADDRESS), T(ACT_ESCAPE, ST_CONTROL)),
+    [ST_SEQUENCE] = ROW(T(ACT_FIELD, ST_BCC1), T(ACT_OPEN, ST_ADDRESS), T(ACT_ESCAPE, ST_SEQUENCE)),
+    [ST_BCC1] = ROW(T(ACT_FIELD, ST_INFO), T(ACT_OPEN, ST_ADDRESS), T(ACT_ESCAPE, ST_BCC1)),
+    [ST_INFO] = ROW(T(ACT_INFO, ST_INFO), T(ACT_CLOSE, ST_ADDRESS), T(ACT_INFO, ST_INFO)),
+};
+
+// What each control field means: frame type, 1-bit N, and whether an N byte follows
+typedef struct
+{
+    unsigned char type;
+    unsigned char n;
+    unsigned char extended;
+} ControlInfo;
+
+static const ControlInfo controls[256] = {
+    [C_I0] = {FRAME_I, 0, 0},
+    [C_I1] = {FRAME_I, 1, 0},
+    [C_RR0] = {FRAME_RR, 0, 0},
+    [C_RR1] = {FRAME_RR, 1, 0},
+    [C_REJ0] = {FRAME_REJ, 0, 0},
+    [C_REJ1] = {FRAME_REJ, 1, 0},
+    [C_SREJ0] = {FRAME_SREJ, 0, 0},
+    [C_SREJ1] = {FRAME_SREJ, 1, 0},
+    [C_RNR0] = {FRAME_RNR, 0, 0},
+    [C_RNR1] = {FRAME_RNR, 1, 0},
+    [C_IX] = {FRAME_I, 0, 1},
+    [C_RRX] = {FRAME_RR, 0, 1},
+    [C_REJX] = {FRAME_REJ, 0, 1},
+    [C_SREJX] = {FRAME_SREJ, 0, 1},
+    [C_RNRX] = {FRAME_RNR, 0, 1},
+    [C_SET] = {FRAME_SET, 0, 0},
+    [C_UA] = {FRAME_UA, 0, 0},
+    [C_DISC] = {FRAME_DISC, 0, 0},
+    [C_UI] = {FRAME_UI, 0, 0},
+};
+
+// FEC level tags, at least 5 bits apart: 2 bit errors still name the level
+static const unsigned char fecTags[FEC_LEVELS] = {0x00, 0x1F, 0xE3, 0xFC};
+
+int fecParity(int level)
+{
+    return level ? 4 << level : 0;
+}
+
+unsigned char fecTag(int level)
+{
+    return fecTags[level];
+}
+
+// Level named by a tag, or -1
+static int fecLevel(unsigned char tag)
+{
+    for (int level = 0; level < FEC_LEVELS; level++)
+    {
+        if (__builtin_popcount(tag ^ fecTags[level]) <= 2) return level;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////
+// Parser
+////////////////////////////////////////////////
+
+// I and UI frames carry a payload: their information field gets the frame
+// check, encoding and FEC agreed on
+static int carriesPayload(unsigned char type)
+{
+    return type == FRAME_I || type == FRAME_UI;
+}
+
+static void startFrame(FrameParser *parser)
+{
+    parser->headerSize = 0;
+    parser->dataSize = 0;
+    memset(&parser->destuff, 0, sizeof(parser->destuff));
+}
+
+void parserReset(FrameParser *parser)
+{
+    startFrame(parser);
+    parser->state = ST_HUNT;
+}
+
+int parserInFrame(const FrameParser *parser)
+{
+    return parser->state > ST_ADDRESS;
+}
+
+static void headerByte(FrameParser *parser, unsigned char byte)
+{
+    if (parser->destuff.escaped)
+    {
+        parser->destuff.escaped = 0;
+        if (byte == ESCAUX) byte = FLAG;
+        else if (byte == ESCAUX2) byte = ESC;
+        else parser->destuff.malformed = 1;
+    }
+    parser->header[parser->headerSize++] = byte;
+}
+
+// Check the information field in the parser's buffer (FEC repairs it in
+// place first) and fill in the rest of event
+static void checkInformation(FrameParser *parser, int fieldSize, unsigned char bcc, int wellFormed, FrameEvent *event)
+{
+    unsigned char *field = parser->data;
+
+    event->field = field;
+    event->fieldSize = fieldSize;
+    event->data = field;
+    event->dataSize = 0;
+    event->valid = wellFormed;
+    event->corrected = 0;
+
+    if (carriesPayload(event->type) && parser->fec)
+    {
+        // Repair payload and check in place; BCC2 then has to be redone
+        int level = (fieldSize > 0) ? fecLevel(field[0]) : -1;
+        if (!wellFormed || level < 0)
+        {
+            event->valid = 0;
+            return;
+        }
+
+        event->corrected = rsDecode(&field[1], fieldSize - 1, fecParity(level), &fieldSize);
+        if (event->corrected < 0)
+        {
+            event->valid = 0;
+            return;
+        }
+        event->data = ++field;
+        if (!parser->crc32c) bcc = calcBCC2(field, fieldSize);
+    }
+
+    if (carriesPayload(event->type) && parser->crc32c)
+    {
+        // CRC-32C, most significant byte first
+        event->dataSize = fieldSize - 4;
+        if (event->dataSize < 0)
+        {
+            event->valid = 0;
+            return;
+        }
+
+        const unsigned char *crc = &field[event->dataSize];
+        event->valid = wellFormed && crc32c(0, field, event->dataSize) ==
+                                         ((uint32_t)crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3]);
+    }
+    else if (carriesPayload(event->type) || fieldSize > 0)
+    {
+        // The destuffed field ends with BCC2, so it XORs to 0 when intact.
+        // Only I and UI frames must have one; SET and UA may carry capabilities.
+        event->dataSize = fieldSize - 1;
+        event->valid = wellFormed && fieldSize > 0 && bcc == 0;
+    }
+}
+
+static void completeFrame(FrameParser *parser, FrameEvent *event)
+{
+    const unsigned char *header = parser->header;
+    const ControlInfo *info = &controls[header[1]];
+
+    event->address = header[0];
+    event->control = header[1];
+    event->type = (info->type == FRAME_NONE) ? FRAME_UNKNOWN : info->type;
+    event->extended = info->extended;
+    event->n = info->extended ? header[2] : info->n;
+
+    unsigned char bcc1 = calcBCC1(header[0], header[1]);
+    if (info->extended) bcc1 ^= header[2];
+    event->headerValid = (header[0] == A_TX || header[0] == A_RX) &&
+                         event->n < SEQ_MODULUS_EXT && bcc1 == header[parser->headerSize - 1];
+
+    int wellFormed = event->headerValid && !parser->destuff.malformed && !parser->destuff.escaped;
+    checkInformation(parser, parser->dataSize, parser->destuff.bcc, wellFormed, event);
+}
+
+void parserRecheck(FrameParser *parser, const unsigned char *field, int fieldSize, FrameEvent *event)
+{
+    memcpy(parser->data, field, fieldSize);
+    unsigned char bcc = (parser->crc32c || parser->fec) ? 0 : calcBCC2(field, fieldSize);
+    checkInformation(parser, fieldSize, bcc, event->headerValid, event);
+}
+
+int parserFeed(FrameParser *parser, const unsigned char *bytes, int length, FrameEvent *event)
+{
+    int i = 0;
+    event->type = FRAME_NONE;
+
+    while (i < length)
+    {
+        unsigned char byte = bytes[i];
+        int cls = byteClass[byte];
+        if (cls == BYTE_ESC && parser->destuff.escaped) cls = BYTE_DATA; // ESC ESC: malformed
+
+        const Transition *t = &transitions[parser->state][cls];
+        parser->state = t->next;
+
+        switch (t->action)
+        {
+        case ACT_SKIP:
+        {
+            const unsigned char *flag = memchr(&bytes[i], FLAG, length - i);
+            i = flag ? flag - bytes : length;
+            continue;
+        }
+        case ACT_OPEN:
+            startFrame(parser);
+            break;
+        case ACT_ESCAPE:
+            parser->destuff.escaped = 1;
+            break;
+        case ACT_CONTROL:
+            headerByte(parser, byte);
+            if (controls[parser->header[1]].extended) parser->state = ST_SEQUENCE;
+            break;
+        case ACT_FIELD:
+            headerByte(parser, byte);
+            break;
+        case ACT_INFO:
+            if (parser->cobs && carriesPayload(controls[parser->header[1]].type))
+                i += cobsDecodeBCC2(&bytes[i], length - i, parser->data, &parser->dataSize, parser->capacity, &parser->destuff);
+            else
+                i += destuffBCC2(&bytes[i], length - i, parser->data, &parser->dataSize, parser->capacity, &parser->destuff);
+            if (i < length && bytes[i] != FLAG)
+            {
+                printf("[parser] Frame too long\n");
+                parserReset(parser);
+            }
+            continue;
+        case ACT_CLOSE:
+            completeFrame(parser, event);
+            startFrame(parser);
+            return i + 1;
+        }
+        i++;
+    }
+    return i;
+}
@@ -0,0 +1,84 @@
+// Streaming frame parser header.
+
+#ifndef FRAME_PARSER_H
+#define FRAME_PARSER_H
+
+#include "byte_stuffing.h"
+#include "utils.h"
+
+typedef enum
+{
+    FRAME_NONE, // no complete frame yet
+    FRAME_I,
+    FRAME_RR,
+    FRAME_REJ,
+    FRAME_SREJ,
+    FRAME_RNR,
+    FRAME_SET,
+    FRAME_UA,
+    FRAME_DISC,
+    FRAME_UI, // unnumbered information (one-way links)
+    FRAME_UNKNOWN, // control field not recognised
+} FrameType;
+
+// One received frame, typed from its control field.
+typedef struct
+{
+    FrameType type;
+    unsigned char address;
+    unsigned char control;      // as received
+    int n;                      // N(S) of I frames, N(R) of RR/REJ/SREJ/RNR
+    int extended;               // 7-bit sequence number field
+    int headerValid;            // known address and BCC1 matched
+    int valid;                  // headerValid, escapes well formed and the information field's check matched
+    const unsigned char *data;  // information field without its check, in the parser's buffer
+    int dataSize;
+    int corrected;              // bytes repaired by FEC, -1 if there were too many
+    const unsigned char *field; // whole information field (check and FEC included), as far as FEC repaired it
+    int fieldSize;
+} FrameEvent;
+
+// Forward error correction levels: Reed-Solomon parity bytes per 255-byte
+// codeword (0, 8, 16, 32). With FEC, the information field of I frames is
+// a tag naming the level, then payload and check with their parity
+// (reed_solomon.h), all stuffed or COBS encoded as usual.
+#define FEC_LEVELS 4
+
+int fecParity(int level);
+unsigned char fecTag(int level);
+
+typedef struct
+{
+    int crc32c; // I (and UI) frames end with a CRC-32C instead of BCC2 (set by the owner)
+    int cobs;   // their information fields are COBS encoded instead of stuffed (same)
+    int fec;    // their information fields carry FEC (same)
+    unsigned char *data; // information field, destuffed (buffer given by the owner)
+    int capacity;        // its size: longer frames are dropped
+    int state;
+    unsigned char header[4];
+    int headerSize;
+    DestuffState destuff; // information field only: BCC2 is the XOR of what precedes it
+    int dataSize;
+} FrameParser;
+
+// Forget any partial frame and wait for the next FLAG.
+void parserReset(FrameParser *parser);
+
+// TRUE while part of a frame has been received.
+int parserInFrame(const FrameParser *parser);
+
+// Feed length bytes of the line, in chunks of any size. Bytes are destuffed
+// and checked as they go by; the header through a transition table, the
+// information field through destuffBCC2() or cobsDecodeBCC2(), then FEC
+// repairs what it can before the check.
+// Stops after the first complete frame: fills *event (whose data stays valid
+// until the next call) and returns the bytes consumed, closing FLAG included.
+// Otherwise consumes everything and sets event->type to FRAME_NONE.
+int parserFeed(FrameParser *parser, const unsigned char *bytes, int length, FrameEvent *event);
+
+// Check another version of the information field of the frame in *event
+// (e.g. rebuilt from several corrupted copies of it): copies it into the
+// parser's buffer and fills in event like parserFeed() would have.
+void parserRecheck(FrameParser *parser, const unsigned char *field, int fieldSize, FrameEvent *event);
+
+#endif
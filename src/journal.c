@@ -0,0 +1,257 @@
+// Transfer journal: how much of a file is safely on disk, and its chunk hashes
+
+#include "journal.h"
+
+#include "crc32c.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Journal file: the magic, the file size (8 bytes, least significant first),
+// the name (length byte, then the name), and the CRC-32C of all of that;
+// then a record per chunk, its CRC-32C followed by the CRC-32C of those 4 bytes
+#define JOURNAL_MAGIC "RCJ1"
+#define JOURNAL_MAGIC_SIZE 4
+#define RECORD_SIZE 8
+
+static void put32(unsigned char *buf, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint32_t get32(const unsigned char *buf)
+{
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+// Bytes of the file in its first chunks
+static long chunkBytes(const Journal *journal, int chunks)
+{
+    long bytes = (long)chunks * JOURNAL_CHUNK_SIZE;
+    return (bytes < journal->size) ? bytes : journal->size;
+}
+
+static int addHash(Journal *journal, uint32_t hash)
+{
+    if (journal->chunks == journal->capacity)
+    {
+        int capacity = journal->capacity ? 2 * journal->capacity : 64;
+        uint32_t *hashes = realloc(journal->hashes, capacity * sizeof(uint32_t));
+        if (!hashes) return -1;
+        journal->hashes = hashes;
+        journal->capacity = capacity;
+    }
+    journal->hashes[journal->chunks++] = hash;
+    return 0;
+}
+
+static int writeAll(int fd, const unsigned char *buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) return -1;
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void putRecord(unsigned char *record, uint32_t hash)
+{
+    put32(record, hash);
+    put32(&record[4], crc32c(0, record, 4));
+}
+
+// Load the header and the records that are whole and intact, which stop at
+// the first that is not (a write cut short by a crash)
+static void loadJournal(Journal *journal, const unsigned char *buf, long size)
+{
+    int headerSize = JOURNAL_MAGIC_SIZE + 8 + 1;
+    if (size < headerSize + 4 || memcmp(buf, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0) return;
+    int nameLength = buf[headerSize - 1];
+    headerSize += nameLength;
+    if (size < headerSize + 4 || get32(&buf[headerSize]) != crc32c(0, buf, headerSize)) return;
+
+    long fileSize = 0;
+    for (int i = 7; i >= 0; i--) fileSize = (fileSize << 8) | buf[JOURNAL_MAGIC_SIZE + i];
+    journal->size = fileSize;
+    memcpy(journal->name, &buf[JOURNAL_MAGIC_SIZE + 9], nameLength);
+    journal->name[nameLength] = '\0';
+
+    for (long i = headerSize + 4; i + RECORD_SIZE <= size; i += RECORD_SIZE)
+    {
+        if (get32(&buf[i + 4]) != crc32c(0, &buf[i], 4) || chunkBytes(journal, journal->chunks) >= fileSize) break;
+        if (addHash(journal, get32(&buf[i])) < 0) break;
+    }
+    journal->offset = chunkBytes(journal, journal->chunks);
+}
+
+int journalOpen(Journal *journal, const char *path)
+{
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    if (strlen(path) >= sizeof(journal->path)) return -1;
+    strcpy(journal->path, path);
+
+    // No journal yet is an empty one, created by journalStart()
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    unsigned char *buf = NULL;
+    long size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (buf = malloc(st.st_size)))
+    {
+        ssize_t n;
+        while (size < st.st_size && (n = read(fd, &buf[size], st.st_size - size)) > 0) size += n;
+        loadJournal(journal, buf, size);
+    }
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+int journalMatches(const Journal *journal, const char *name, long size)
+{
+    return journal->name[0] != '\0' && strcmp(journal->name, name) == 0 && journal->size == size;
+}
+
+long journalVerify(Journal *journal, int fd)
+{
+    unsigned char *buf = malloc(JOURNAL_CHUNK_SIZE);
+    int good = 0;
+
+    while (buf && good < journal->chunks)
+    {
+        long start = chunkBytes(journal, good);
+        long length = chunkBytes(journal, good + 1) - start;
+        if (pread(fd, buf, length, start) != length || crc32c(0, buf, length) != journal->hashes[good]) break;
+        good++;
+    }
+
+    free(buf);
+    journal->chunks = good;
+    journal->offset = chunkBytes(journal, good);
+    return journal->offset;
+}
+
+uint32_t journalPrefixHash(const Journal *journal, long offset)
+{
+    int chunks = (offset + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE;
+    if (chunks > journal->chunks) chunks = journal->chunks;
+
+    uint32_t crc = 0;
+    for (int i = 0; i < chunks; i++)
+    {
+        unsigned char hash[4];
+        put32(hash, journal->hashes[i]);
+        crc = crc32c(crc, hash, 4);
+    }
+    return crc;
+}
+
+int journalFileHash(int fd, long offset, uint32_t *hash)
+{
+    unsigned char *buf = malloc(JOURNAL_CHUNK_SIZE);
+    uint32_t crc = 0;
+    long start = 0;
+
+    while (buf && start < offset)
+    {
+        long length = (offset - start < JOURNAL_CHUNK_SIZE) ? offset - start : JOURNAL_CHUNK_SIZE;
+        if (pread(fd, buf, length, start) != length) break;
+        unsigned char chunkHash[4];
+        put32(chunkHash, crc32c(0, buf, length));
+        crc = crc32c(crc, chunkHash, 4);
+        start += length;
+    }
+
+    free(buf);
+    *hash = crc;
+    return (start == offset) ? 0 : -1;
+}
+
+int journalStart(Journal *journal, const char *name, long size, long offset)
+{
+    int nameLength = strlen(name);
+    if (nameLength > 255) return -1;
+
+    int keep = (offset + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE;
+    if (!journalMatches(journal, name, size) || keep > journal->chunks) keep = 0;
+    strcpy(journal->name, name);
+    journal->size = size;
+    journal->chunks = keep;
+    journal->offset = chunkBytes(journal, keep);
+    journal->crc = 0;
+
+    int headerSize = JOURNAL_MAGIC_SIZE + 9 + nameLength;
+    long bufSize = headerSize + 4 + (long)keep * RECORD_SIZE;
+    unsigned char *buf = malloc(bufSize);
+    if (!buf) return -1;
+    memcpy(buf, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+    for (int i = 0; i < 8; i++) buf[JOURNAL_MAGIC_SIZE + i] = ((unsigned long)size >> (8 * i)) & 0xFF;
+    buf[JOURNAL_MAGIC_SIZE + 8] = nameLength;
+    memcpy(&buf[JOURNAL_MAGIC_SIZE + 9], name, nameLength);
+    put32(&buf[headerSize], crc32c(0, buf, headerSize));
+    for (int i = 0; i < keep; i++) putRecord(&buf[headerSize + 4 + i * RECORD_SIZE], journal->hashes[i]);
+
+    // Written in full before it replaces the old one, so a crash leaves one
+    // or the other
+    char tmpPath[sizeof(journal->path) + 4];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.new", journal->path);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    int result = (fd >= 0 && writeAll(fd, buf, bufSize) == 0 && fdatasync(fd) == 0 && rename(tmpPath, journal->path) == 0) ? 0 : -1;
+    free(buf);
+
+    if (result < 0)
+    {
+        if (fd >= 0) close(fd);
+        unlink(tmpPath);
+        return -1;
+    }
+    if (journal->fd >= 0) close(journal->fd);
+    journal->fd = fd;
+    return 0;
+}
+
+int journalAdd(Journal *journal, const unsigned char *data, int size, int dataFd)
+{
+    while (size > 0)
+    {
+        long start = chunkBytes(journal, journal->chunks);
+        long length = chunkBytes(journal, journal->chunks + 1) - start;
+        long take = length - (journal->offset - start);
+        if (take <= 0) return -1; // past the end of the file
+        if (take > size) take = size;
+
+        journal->crc = crc32c(journal->crc, data, take);
+        journal->offset += take;
+        data += take;
+        size -= take;
+        if (journal->offset < start + length) break;
+
+        // Chunk complete: the data goes to disk before the record that says so
+        unsigned char record[RECORD_SIZE];
+        putRecord(record, journal->crc);
+        if (dataFd >= 0 && fdatasync(dataFd) < 0) return -1;
+        if (addHash(journal, journal->crc) < 0) return -1;
+        if (journal->fd < 0 || writeAll(journal->fd, record, RECORD_SIZE) < 0 || fdatasync(journal->fd) < 0) return -1;
+        journal->crc = 0;
+    }
+    return 0;
+}
+
+void journalClose(Journal *journal, int done)
+{
+    if (journal->fd >= 0) close(journal->fd);
+    journal->fd = -1;
+    free(journal->hashes);
+    journal->hashes = NULL;
+    journal->chunks = journal->capacity = 0;
+    if (done) unlink(journal->path);
+}
@@ -0,0 +1,65 @@
+// Transfer journal header.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+// The file is cut into chunks of JOURNAL_CHUNK_SIZE bytes, the last one
+// shorter
+#define JOURNAL_CHUNK_SIZE 16384
+
+// Persistent record of how much of a file went through, kept next to it so
+// that an interrupted transfer can pick up where it stopped. The journal file
+// holds the file identity (name and size) and the CRC-32C of each complete
+// chunk, appended and synced once the chunk itself is on disk, so after a
+// crash it never claims more than the file has. A torn last record is
+// dropped when the journal is loaded.
+typedef struct
+{
+    int fd;
+    char path[512];
+    char name[256];    // identity of the file: empty if none was loaded
+    long size;
+    long offset;       // bytes added so far
+    uint32_t *hashes;  // CRC-32C of each complete chunk
+    int chunks;
+    int capacity;
+    uint32_t crc;      // CRC-32C of the chunk being filled
+} Journal;
+
+// Open the journal at path, creating it if there is none, and load the
+// identity and chunks of the one there. Returns 0 or -1 on error.
+int journalOpen(Journal *journal, const char *path);
+
+// Whether the journal is about this file
+int journalMatches(const Journal *journal, const char *name, long size);
+
+// Check the chunks against the file at fd, dropping the first that differs
+// (or is not all there) and the ones after it.
+// Returns the number of bytes checked.
+long journalVerify(Journal *journal, int fd);
+
+// CRC-32C of the hashes of the chunks below offset (a chunk boundary or the
+// end of the file), which two ends compare to agree on a prefix
+uint32_t journalPrefixHash(const Journal *journal, long offset);
+
+// The same hash worked out from the file at fd itself, for the end that has
+// all of it. Returns 0 or -1 if the file is shorter than offset.
+int journalFileHash(int fd, long offset, uint32_t *hash);
+
+// Start journaling a transfer of this file from offset, keeping the chunks
+// below it. The journal is rewritten (to a new file, renamed over the old one).
+// Returns 0 or -1 on error.
+int journalStart(Journal *journal, const char *name, long size, long offset);
+
+// Add the next size bytes of the file. Each chunk they complete is recorded,
+// after syncing dataFd (the file being written, -1 for none) so that the
+// record never gets to disk before the data.
+// Returns 0 or -1 on error.
+int journalAdd(Journal *journal, const unsigned char *data, int size, int dataFd);
+
+// Close the journal, removing it if the transfer is done
+void journalClose(Journal *journal, int done);
+
+#endif
@@ -1,526 +1,2696 @@
 
 #include "link_layer.h"
 #include "serial_port.h"
+#include "byte_stuffing.h"
+#include "crc32c.h"
+#include "frame_parser.h"
+#include "lz.h"
+#include "reed_solomon.h"
 #include "utils.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// Receive batching: in the middle of a frame, let up to RX_BATCH_BYTES
+// accumulate (at most RX_BATCH_MAX_MS) before the next read()
+#define RX_BATCH_BYTES 64
+#define RX_BATCH_MAX_MS 5.0
+
+// Retransmission timeout bounds (ms)
+#define RTO_MIN_MS 20.0
+#define RTO_MAX_MS 60000.0
+
+// Adaptive FEC: starts at FEC_START_LEVEL and is raised as soon as more than
+// FEC_RAISE_RATE of a window of FEC_WINDOW frames sent are retransmissions;
+// lowered after a run of windows without any. That run starts at
+// FEC_MIN_CLEAN_WINDOWS and doubles on every raise, so a level that keeps
+// failing is retried less often.
+#define FEC_START_LEVEL LlFecRs239
+#define FEC_WINDOW 32
+#define FEC_RAISE_RATE 0.05
+#define FEC_MIN_CLEAN_WINDOWS 2
+#define FEC_MAX_CLEAN_WINDOWS 64
+
+// Adaptive payload size: judged every SIZE_WINDOW new frames on how many
+// REJ, SREJ and timeouts they took. A clean window doubles the size (up to
+// what was agreed on), one with errors moves it to the best size for the
+// error rate seen, never below SIZE_MIN_PAYLOAD. SIZE_FRAME_OVERHEAD is
+// what each frame costs besides its payload: header, check, FLAG, the
+// packet header and the RR coming back.
+#define SIZE_WINDOW 16
+#define SIZE_MIN_PAYLOAD 64
+#define SIZE_FRAME_OVERHEAD 16
+
+// Receiver flow control: the delivery queue holds a window of frames plus
+// RX_QUEUE_SPARE more; once the application leaves more than that many
+// waiting the transmitter is sent RNR, and RR again when half are taken.
+// The transmitter polls a receiver that sent RNR at its RTO, backing off
+// up to POLL_MAX_MS, for as long as it takes.
+#define RX_QUEUE_SPARE 8
+#define POLL_MAX_MS 2000.0
+
+// A line taken as down is probed with a resync SET at the RTO, backing off
+// up to RESYNC_MAX_MS
+#define RESYNC_MAX_MS 4000.0
+
+// Chase combining: failed copies kept per frame, and how many bytes (FEC:
+// codewords) may differ between the last two for every mix of them to be
+// tried (2^n checks)
+#define HARQ_COPIES 3
+#define HARQ_MAX_GUESSES 8
+
+// With compression, payloads start with one of these
+#define PAYLOAD_STORED 0x00
+#define PAYLOAD_LZ 0x01
+
+// With aggregation, payloads are packets each behind its size (2 bytes,
+// most significant first)
+#define PACKET_HEADER_SIZE 2
 
-#define TIMEOUT_SECS 3
+static LinkLayer connection;
+static int serialFd = -1;
+static int expectedNs = 0;
+static unsigned char sequenceNumber = 0; // Ns of the next new frame
+static int modulus = 2;                  // 2 (window 1) or SEQ_MODULUS_EXT
+
+// Go-Back-N sender window: encoded frames indexed by Ns, kept until acknowledged
+typedef struct
+{
+    unsigned char *frame;
+    int size;
+    double sentAt;     // ms, last (re)transmission
+    double wireTime;   // ms until this frame (and whatever was queued ahead of it) is on the line
+    int retransmitted; // Karn's rule: no RTT sample from retransmitted frames
+    int retries;       // timeouts (and REJs) for this frame so far
+    int timerFd;       // retransmission timer of this frame
+    int expired;       // timer fired, retransmission pending
+    unsigned char *field; // FEC: tag, payload, check and parity before stuffing
+    int payloadSize;   // FEC: payload size
+    int fecLevel;      // FEC: level the frame was encoded at
+} TxFrame;
+
+static TxFrame txWindow[SEQ_MODULUS_EXT];
+static int txBase = 0; // Ns of the oldest unacknowledged frame
+
+// Round-trip estimation (Jacobson/Karels), all in ms.
+// Samples exclude serialization time, so srtt tracks propagation and
+// turnaround delay; each frame's deadline adds its own wireTime back.
+static double srtt = -1; // no sample yet
+static double rttvar = 0;
+static double rto = 0;
+static double lineFreeAt = 0; // when the bytes written so far will have left the port
+
+// Event loop: one epoll set watching the serial port and the timers.
+// Frame timers are tagged with their Ns, the others with these values.
+#define EVENT_SERIAL 0xFFFF
+#define EVENT_CONTROL_TIMER 0xFFFE
+#define EVENT_ACK_TIMER 0xFFFD
+#define EVENT_BATCH_TIMER 0xFFFC
+
+static int epollFd = -1;
+static int controlTimerFd = -1; // SET retransmissions
+static int controlExpired = FALSE;
+static int ackTimerFd = -1;     // receiver: delayed RR
+static int batchTimerFd = -1;   // transmitter: held back packets
+static int batchExpired = FALSE;
+
+// Receiver: frames taken in sequence since the last RR (or REJ)
+static int framesUnacked = 0;
+
+// Receiver: REJ already sent for the current gap
+static int rejSent = FALSE;
+
+// Selective Repeat receive buffer: frames that arrived after a gap, indexed
+// by Ns, kept until the gap is filled and they can be delivered in order
+typedef struct
+{
+    unsigned char *data;
+    int size;
+    int present;
+    int srejSent;
+} RxFrame;
+
+static RxFrame rxWindow[SEQ_MODULUS_EXT];
+
+// Delivery queue: payloads taken in sequence, waiting for llread()
+static RxFrame *rxQueue;
+static int rxQueueSlots = 0;
+static int rxQueueHead = 0;
+static int rxQueueCount = 0;
+static int rxQueueTaken = FALSE; // its head was handed to the application
+
+// Packets carried in SET, UA and DISC: this end's, for llopenWith() and
+// llcloseWith(), and whether the receiver took the one in the SET (receiver:
+// whether it was queued). The transmitter keeps the one in the UA for
+// llopenAnswer().
+static unsigned char openPacket[MAX_PIGGYBACK_SIZE];
+static int openPacketSize = 0;
+static int openPacketTaken = FALSE;
+static unsigned char answerPacket[MAX_PIGGYBACK_SIZE];
+static int answerPacketSize = 0;
+static const unsigned char *closePacket;
+static int closePacketSize = 0;
+static int piggybackEnabled = FALSE; // DISC packets, agreed on in SET/UA
+
+// Resynchronisation after the line was down, agreed on in SET/UA
+static int resyncEnabled = FALSE;
+
+// RNR, agreed on in SET/UA
+static int rnrEnabled = FALSE;
+static int rnrSent = FALSE;  // receiver: the last acknowledgement was RNR
+static int peerBusy = FALSE; // transmitter: the receiver sent RNR
+static int pollsUnanswered = 0;
+static double pollInterval;
+static double pausedSince;
+
+// Chase combining: copies of each frame in the receive window that failed
+// their check, until a copy or a combination of them passes
+typedef struct
+{
+    unsigned char *copies[HARQ_COPIES];
+    int size;  // information field size, the same in every copy
+    int count;
+    int next;  // slot for the next copy, the oldest one once all are used
+} HarqFrame;
+
+static HarqFrame harqWindow[SEQ_MODULUS_EXT];
+static unsigned char *harqField; // combination being checked
+static int *harqPositions;       // where the last two copies differ
+static unsigned char *harqUnits; // which byte or codeword each of them is in
+
+// Frame buffers, allocated at llopen for the largest payload this end
+// offers (what the peer agrees on can only be smaller)
+static int fieldCapacity; // information field before stuffing
+static int frameCapacity; // whole frame after it
+static unsigned char *packed;   // transmitter: payload being compressed
+static unsigned char *unpacked; // receiver: payload expanded
+
+// Aggregation: packets waiting to go out together, and what is left of the
+// last payload received
+static unsigned char *batch;
+static int batchSize;
+static const unsigned char *rxBatch;
+static int rxBatchLeft;
+
+// Every frame read, whichever call is waiting, goes through this parser
+static FrameParser parser;
+
+// The peer's DISC has been received (possibly by llread())
+static int discReceived = FALSE;
+
+// Receiver: an I frame was taken or a packet read since the SET, so another
+// SET starts a new session
+static int sessionStarted = FALSE;
+
+// Frame check and payload encoding of I frames, agreed on in SET/UA
+static LinkLayerCheck frameCheck = LlCheckBcc2;
+static LinkLayerFraming framing = LlFramingStuffing;
+static int capabilitiesSeen = FALSE; // receiver: the transmitter sent capabilities
+
+// Largest payload, compression and aggregation, also agreed on in SET/UA
+static int maxPayload = MAX_PAYLOAD_SIZE;
+static int compressionEnabled = FALSE;
+static int aggregationEnabled = FALSE;
+
+// What a connection runs with. Window and ARQ are written back into
+// connection once agreed on.
+typedef struct
+{
+    LinkLayerCheck check;
+    LinkLayerFraming framing;
+    int fec;
+    int windowSize;
+    LinkLayerArq arq;
+    int maxPayload;
+    int compression;
+    int aggregation;
+    int rnr;
+    int piggyback;
+    int resync;
+} Capabilities;
+
+static Capabilities offer; // this end's configuration: the most it agrees to
+
+// Forward error correction of I frames, also agreed on in SET/UA
+static int fecEnabled = FALSE;
+static int fecLevel = 0; // transmitter: level of the next new frame
+static struct
+{
+    int frames;          // frames sent in this window
+    int retransmissions; // how many of them were retransmissions
+    int cleanWindows;    // windows in a row without any
+    int cleanNeeded;     // before trying a lower level
+} fecWindow;
+
+// Adaptive payload size (transmitter)
+static int payloadTarget = MAX_PAYLOAD_SIZE; // what llpayloadSize() suggests
+static double lossPerByte = 0; // -ln of the chance a byte on the line gets through, smoothed
+static struct
+{
+    int frames;        // new frames sent in this window
+    int errors;        // REJ, SREJ and timeouts meanwhile
+    long wireBytes;    // bytes those frames took on the line
+    long payloadBytes; // their payloads, as handed to llwrite()
+} sizeWindow;
+
+// Transmission statistics
+static struct
+{
+    int framesSent;
+    int framesEncoded;  // I frames built; retransmissions reuse the encoded frame
+    long payloadBytes;  // bytes handed to llwrite()
+    long encodedBytes;  // bytes written into the window slots for them
+    long packedBytes;   // the payloads once compressed, with their marker byte
+    int packetsSent;    // llwrite() calls, several to a frame with aggregation
+    int packetsReceived;
+    int retransmissions;
+    int timeouts;
+    int framesReceived;
+    int framesDropped; // one-way receiver: UI frames that failed their check
+    int rejSent;
+    int srejSent;
+    int framesBuffered;
+    int fecRaised;
+    int fecLowered;
+    int fecReencoded; // retransmissions encoded again at a higher level
+    int fecFrames;    // frames FEC repaired
+    long fecBytes;    // bytes it repaired in them
+    int fecFailures;  // frames with more errors than it could repair
+    int harqCopies;   // failed copies kept for chase combining
+    int harqMajority; // frames rebuilt from three copies
+    int harqPairs;    // frames rebuilt from the last two
+    int sizeGrown;    // times the adaptive payload size went up
+    int sizeShrunk;   // and down
+    int sizeSmallest; // smallest and largest it was
+    int sizeLargest;
+    int epollWaits;
+    int rrSent;
+    int rnrSent;        // receiver: times it told the transmitter to wait
+    int framesRefused;  // and frames dropped for want of room meanwhile
+    int queuePeak;      // most payloads waiting for the application
+    int rnrReceived;    // transmitter: times it was told to wait
+    int polls;
+    double pausedMs;
+    int outages;        // transmitter: times the line was taken as down
+    int resyncProbes;
+    double outageMs;    // and how long until it came back
+} stats;
+
+#define _POSIX_SOURCE 1 // POSIX compliant source
+
+////////////////////////////////////////////////
+// Event loop
+////////////////////////////////////////////////
+static double nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Time to put one byte on the line: start + 8 data + stop bits
+static double byteTimeMs()
+{
+    return 10000.0 / connection.baudRate;
+}
+
+// Returns 0 or -1 if the timer could not be set (no such timer)
+static int armTimer(int timerFd, double ms)
+{
+    if (ms < 0.001) ms = 0.001;
+
+    struct itimerspec its = {0};
+    long ns = (long)(ms * 1e6);
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    return timerfd_settime(timerFd, 0, &its, NULL);
+}
+
+static void stopTimer(int timerFd)
+{
+    struct itimerspec its = {0};
+    timerfd_settime(timerFd, 0, &its, NULL);
+}
+
+static int watchFd(int fd, uint32_t tag)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = tag};
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Sleep until the serial port has data or a timer expires (block == FALSE:
+// only collect what is already pending). Expired timers are flagged in
+// TxFrame.expired / controlExpired for the caller to act on; the ack timer
+// is handled here.
+// Returns TRUE if any timer expired.
+static void flushAck();
+
+static int waitForEvents(int block)
+{
+    struct epoll_event events[16];
+    int expired = FALSE;
+
+    int n = epoll_wait(epollFd, events, 16, block ? -1 : 0);
+    stats.epollWaits++;
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t tag = events[i].data.u32;
+        if (tag == EVENT_SERIAL) continue;
+
+        int timerFd = (tag == EVENT_CONTROL_TIMER) ? controlTimerFd
+                      : (tag == EVENT_ACK_TIMER)   ? ackTimerFd
+                      : (tag == EVENT_BATCH_TIMER) ? batchTimerFd
+                                                   : txWindow[tag].timerFd;
+        uint64_t count;
+        if (read(timerFd, &count, sizeof(count)) != sizeof(count)) continue; // re-armed meanwhile
+
+        // The delayed RR goes out whatever the receiver is waiting for
+        if (tag == EVENT_ACK_TIMER)
+        {
+            flushAck();
+            continue;
+        }
+
+        if (tag == EVENT_CONTROL_TIMER) controlExpired = TRUE;
+        else if (tag == EVENT_BATCH_TIMER) batchExpired = TRUE;
+        else txWindow[tag].expired = TRUE;
+        expired = TRUE;
+    }
+    return expired;
+}
+
+// The port is non-blocking: wait for room when the output queue is full
+static int writeAll(const unsigned char *bytes, int nBytes)
+{
+    int written = 0;
+    while (written < nBytes)
+    {
+        int res = writeBytesSerialPort(bytes + written, nBytes - written);
+        if (res < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR) return -1;
+
+            struct pollfd pfd = {.fd = serialFd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        written += res;
+    }
+    return written;
+}
+
+// Frame timers are made for the configured window (offer, as llopen falls
+// back to stop-and-wait until SET/UA agree on one); the agreed one can only
+// be smaller
+static int openEngine()
+{
+    for (int ns = 0; ns < SEQ_MODULUS_EXT; ns++)
+        txWindow[ns].timerFd = -1;
+
+    int flags = fcntl(serialFd, F_GETFL);
+    if (flags < 0 || fcntl(serialFd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+
+    epollFd = epoll_create1(0);
+    if (epollFd < 0) return -1;
+    if (watchFd(serialFd, EVENT_SERIAL) < 0) return -1;
+
+    controlTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (controlTimerFd < 0 || watchFd(controlTimerFd, EVENT_CONTROL_TIMER) < 0) return -1;
+    ackTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (ackTimerFd < 0 || watchFd(ackTimerFd, EVENT_ACK_TIMER) < 0) return -1;
+    batchTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (batchTimerFd < 0 || watchFd(batchTimerFd, EVENT_BATCH_TIMER) < 0) return -1;
+
+    int timers = (offer.windowSize > 1) ? SEQ_MODULUS_EXT : 2;
+    for (int ns = 0; ns < timers; ns++)
+    {
+        txWindow[ns].timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (txWindow[ns].timerFd < 0 || watchFd(txWindow[ns].timerFd, ns) < 0) return -1;
+    }
+    return 0;
+}
+
+static void closeEngine()
+{
+    for (int ns = 0; ns < SEQ_MODULUS_EXT; ns++)
+    {
+        if (txWindow[ns].timerFd >= 0) close(txWindow[ns].timerFd);
+        txWindow[ns].timerFd = -1;
+    }
+    if (controlTimerFd >= 0) close(controlTimerFd);
+    if (ackTimerFd >= 0) close(ackTimerFd);
+    if (batchTimerFd >= 0) close(batchTimerFd);
+    if (epollFd >= 0) close(epollFd);
+    controlTimerFd = ackTimerFd = batchTimerFd = -1;
+    epollFd = -1;
+}
+
+////////////////////////////////////////////////
+// Frame buffers
+////////////////////////////////////////////////
+static void freeBuffers()
+{
+    for (int ns = 0; ns < SEQ_MODULUS_EXT; ns++)
+    {
+        free(txWindow[ns].frame);
+        free(txWindow[ns].field);
+        free(rxWindow[ns].data);
+        txWindow[ns].frame = txWindow[ns].field = rxWindow[ns].data = NULL;
+        for (int c = 0; c < HARQ_COPIES; c++)
+        {
+            free(harqWindow[ns].copies[c]);
+            harqWindow[ns].copies[c] = NULL;
+        }
+    }
+    free(harqField);
+    free(harqPositions);
+    free(harqUnits);
+    free(packed);
+    free(unpacked);
+    free(batch);
+    free(parser.data);
+    harqField = harqUnits = packed = unpacked = batch = parser.data = NULL;
+    harqPositions = NULL;
+
+    for (int i = 0; i < rxQueueSlots; i++)
+        free(rxQueue[i].data);
+    free(rxQueue);
+    rxQueue = NULL;
+    rxQueueSlots = 0;
+}
+
+// Room for the largest payload offered (at least MAX_FRAME_SIZE, which
+// peers that predate the frame size capability may fill), with its
+// compression byte, CRC-32C and the most FEC, for as many frames as the
+// configured window holds, on the side that needs them. They start in the
+// first slots and move to the sequence numbers that use them (claimTxSlot(),
+// claimRxSlot()). Pages are only touched as frames use them.
+static int allocateBuffers()
+{
+    fieldCapacity = 1 + rsEncodedSize(1 + connection.maxPayload + 4, fecParity(FEC_LEVELS - 1));
+    if (fieldCapacity < MAX_FRAME_SIZE) fieldCapacity = MAX_FRAME_SIZE;
+    frameCapacity = 2 * fieldCapacity + 16; // all of it stuffed, header and FLAGs
+
+    int failed = FALSE;
+    int slots = (connection.windowSize < 1) ? 1 : connection.windowSize;
+    for (int ns = 0; ns < slots && ns < SEQ_MODULUS_EXT; ns++)
+    {
+        if (connection.role == LlTx)
+        {
+            failed |= !(txWindow[ns].frame = malloc(frameCapacity));
+            failed |= !(txWindow[ns].field = malloc(fieldCapacity));
+            continue;
+        }
+        failed |= !(rxWindow[ns].data = malloc(fieldCapacity));
+        for (int c = 0; c < HARQ_COPIES; c++)
+            failed |= !(harqWindow[ns].copies[c] = malloc(fieldCapacity));
+    }
+    failed |= !(harqField = malloc(fieldCapacity));
+    failed |= !(harqPositions = malloc(fieldCapacity * sizeof(int)));
+    failed |= !(harqUnits = malloc(fieldCapacity));
+    failed |= !(packed = malloc(fieldCapacity));
+    failed |= !(unpacked = malloc(fieldCapacity));
+    failed |= !(batch = malloc(fieldCapacity));
+    failed |= !(parser.data = malloc(fieldCapacity));
+    parser.capacity = fieldCapacity;
+
+    if (connection.role == LlRx)
+    {
+        rxQueue = calloc(connection.windowSize + RX_QUEUE_SPARE, sizeof(RxFrame));
+        failed |= !rxQueue;
+        for (; rxQueue && rxQueueSlots < connection.windowSize + RX_QUEUE_SPARE; rxQueueSlots++)
+            failed |= !(rxQueue[rxQueueSlots].data = malloc(fieldCapacity));
+    }
+
+    if (!failed) return 0;
+    freeBuffers();
+    return -1;
+}
+
+// Transmitter: give ns the buffers of a slot no outstanding frame uses
+// (there are as many as the window holds, so one is free)
+static void claimTxSlot(int ns)
+{
+    if (txWindow[ns].frame) return;
+    int outstanding = (sequenceNumber - txBase + modulus) % modulus;
+    for (int i = 0; i < SEQ_MODULUS_EXT; i++)
+    {
+        if (i == ns || !txWindow[i].frame) continue;
+        if (i < modulus && (i - txBase + modulus) % modulus < outstanding) continue;
+        txWindow[ns].frame = txWindow[i].frame;
+        txWindow[ns].field = txWindow[i].field;
+        txWindow[i].frame = txWindow[i].field = NULL;
+        return;
+    }
+}
+
+// Receiver: the same for a frame buffered or kept for chase combining,
+// taking the buffers of a slot outside the receive window
+static void claimRxSlot(int ns)
+{
+    if (rxWindow[ns].data) return;
+    for (int i = 0; i < SEQ_MODULUS_EXT; i++)
+    {
+        if (i == ns || !rxWindow[i].data) continue;
+        if (i < modulus && (i - expectedNs + modulus) % modulus < connection.windowSize) continue;
+        rxWindow[ns].data = rxWindow[i].data;
+        rxWindow[i].data = NULL;
+        rxWindow[i].present = FALSE;
+        for (int c = 0; c < HARQ_COPIES; c++)
+        {
+            harqWindow[ns].copies[c] = harqWindow[i].copies[c];
+            harqWindow[i].copies[c] = NULL;
+        }
+        harqWindow[i].count = harqWindow[i].next = 0;
+        return;
+    }
+}
+
+////////////////////////////////////////////////
+// Control field helpers
+////////////////////////////////////////////////
+static int isExtended()
+{
+    return modulus == SEQ_MODULUS_EXT;
+}
+
+static int isSelectiveRepeat()
+{
+    return isExtended() && connection.arq == LlSelectiveRepeat;
+}
+
+static int isNumbered(unsigned char control)
+{
+    return control == C_IX || control == C_RRX || control == C_REJX || control == C_SREJX || control == C_RNRX;
+}
+
+// Write FLAG, A, C, [N], BCC1 (stuffed) into frame.
+// I/RR/REJ/SREJ/RNR are given as C_IX/C_RRX/C_REJX/C_SREJX/C_RNRX and encoded with the 1-bit or
+// the extended control field depending on the window size.
+// Returns the number of bytes written.
+static int buildHeader(unsigned char *frame, unsigned char address, unsigned char control, int n)
+{
+    unsigned char header[4];
+    int size = 0;
+
+    header[size++] = address;
+
+    if (!isNumbered(control))
+        header[size++] = control;
+    else if (isExtended())
+    {
+        header[size++] = control;
+        header[size++] = n;
+    }
+    else if (control == C_IX)
+        header[size++] = n ? C_I1 : C_I0;
+    else if (control == C_RRX)
+        header[size++] = n ? C_RR1 : C_RR0;
+    else if (control == C_REJX)
+        header[size++] = n ? C_REJ1 : C_REJ0;
+    else if (control == C_RNRX)
+        header[size++] = n ? C_RNR1 : C_RNR0;
+    else
+        header[size++] = n ? C_SREJ1 : C_SREJ0;
+
+    unsigned char bcc1 = calcBCC1(header[0], header[1]);
+    if (size == 3) bcc1 ^= header[2];
+    header[size++] = bcc1;
+
+    frame[0] = FLAG;
+    return 1 + bytestuffing(header, size, &frame[1], 2 * sizeof(header));
+}
+
+////////////////////////////////////////////////
+// Helper: send supervision frame (SET, UA, DISC, RR, REJ, SREJ)
+////////////////////////////////////////////////
+static void sendNumberedSupervisionFrame(unsigned char address, unsigned char control, int n)
+{
+    unsigned char frame[16];
+    int frameSize = buildHeader(frame, address, control, n);
+    frame[frameSize++] = FLAG;
+
+    writeAll(frame, frameSize);
+}
+
+static void sendSupervisionFrame(unsigned char address, unsigned char control)
+{
+    sendNumberedSupervisionFrame(address, control, 0);
+}
+
+// SET/UA with an information field (followed by BCC2).
+// Returns the number of bytes written.
+static int sendUnnumberedFrame(unsigned char address, unsigned char control, const unsigned char *info, int infoSize)
+{
+    unsigned char frame[128 + 2 * (2 + MAX_PIGGYBACK_SIZE)];
+    unsigned char bcc2 = 0;
+    int frameSize = buildHeader(frame, address, control, 0);
+
+    frameSize += bytestuffingBCC2(info, infoSize, &frame[frameSize], sizeof(frame) - frameSize - 3, &bcc2);
+    frameSize += bytestuffing(&bcc2, 1, &frame[frameSize], 2);
+    frame[frameSize++] = FLAG;
+
+    writeAll(frame, frameSize);
+    return frameSize;
+}
+
+////////////////////////////////////////////////
+// Capabilities (TLVs in SET/UA)
+////////////////////////////////////////////////
+
+// What peers that predate a capability run with. Without any capabilities
+// that is the original protocol, stop-and-wait with 1-bit sequence numbers;
+// peers that send some but not the window run the configured window.
+static Capabilities legacyCapabilities(int capabilities)
+{
+    Capabilities legacy = {LlCheckBcc2, LlFramingStuffing, FALSE, capabilities ? offer.windowSize : 1,
+                           capabilities ? offer.arq : LlGoBackN,
+                           offer.maxPayload < MAX_PAYLOAD_SIZE ? offer.maxPayload : MAX_PAYLOAD_SIZE, FALSE, FALSE, FALSE, FALSE, FALSE};
+    return legacy;
+}
+
+// COBS needs CRC-32C: a corrupted code byte only moves a FLAG byte around,
+// which leaves the XOR in BCC2 unchanged.
+static void setCapabilities(Capabilities agreed)
+{
+    if (agreed.check != LlCheckCrc32c) agreed.framing = LlFramingStuffing;
+    frameCheck = agreed.check;
+    framing = agreed.framing;
+    fecEnabled = agreed.fec;
+    parser.crc32c = (agreed.check == LlCheckCrc32c);
+    parser.cobs = (agreed.framing == LlFramingCobs);
+    parser.fec = agreed.fec;
+
+    fecLevel = (connection.fec == LlFecAdaptive) ? FEC_START_LEVEL : connection.fec;
+    memset(&fecWindow, 0, sizeof(fecWindow));
+    fecWindow.cleanNeeded = FEC_MIN_CLEAN_WINDOWS;
+
+    connection.windowSize = agreed.windowSize;
+    connection.arq = agreed.arq;
+    modulus = (agreed.windowSize > 1) ? SEQ_MODULUS_EXT : 2;
+    maxPayload = agreed.maxPayload;
+    compressionEnabled = agreed.compression;
+    aggregationEnabled = agreed.aggregation;
+    batchSize = rxBatchLeft = 0;
+    batchExpired = FALSE;
+    rnrEnabled = agreed.rnr;
+    piggybackEnabled = agreed.piggyback;
+    resyncEnabled = agreed.resync;
+
+    // Adaptive payload size starts at what fixed-size peers use
+    payloadTarget = maxPayload;
+    if (connection.adaptiveFrameSize && !connection.simplex && payloadTarget > MAX_PAYLOAD_SIZE)
+        payloadTarget = MAX_PAYLOAD_SIZE;
+    stats.sizeSmallest = stats.sizeLargest = payloadTarget;
+    lossPerByte = 0;
+    memset(&sizeWindow, 0, sizeof(sizeWindow));
+}
+
+// Value of the first TLV of this type with at least length bytes, or NULL
+static const unsigned char *findCapabilityValue(const unsigned char *info, int size, unsigned char type, int length)
+{
+    for (int i = 0; i + 2 <= size && i + 2 + info[i + 1] <= size; i += 2 + info[i + 1])
+    {
+        if (info[i] == type && info[i + 1] >= length) return &info[i + 2];
+    }
+    return NULL;
+}
+
+// First byte of the value of the first TLV of this type, or -1 if there is none
+static int findCapability(const unsigned char *info, int size, unsigned char type)
+{
+    const unsigned char *value = findCapabilityValue(info, size, type, 1);
+    return value ? value[0] : -1;
+}
+
+// Put a packet for the application in a SET/UA/DISC information field.
+// Returns the bytes written (none for a packet too long to go there).
+static int putPacket(unsigned char *info, const unsigned char *packet, int packetSize)
+{
+    if (!packet || packetSize < 1 || packetSize > MAX_PIGGYBACK_SIZE) return 0;
+    info[0] = CAP_PACKET;
+    info[1] = packetSize;
+    memcpy(&info[2], packet, packetSize);
+    return 2 + packetSize;
+}
+
+// The packet in a SET/UA/DISC, or -1 if there is none
+static int findPacket(const FrameEvent *event, const unsigned char **packet)
+{
+    *packet = findCapabilityValue(event->data, event->dataSize, CAP_PACKET, 1);
+    return *packet ? (*packet)[-1] : -1;
+}
+
+// The smaller of two windows, Selective Repeat only if both take it
+static void agreeWindow(Capabilities *agreed, const unsigned char *window)
+{
+    if (window[0] >= 1 && window[0] < agreed->windowSize) agreed->windowSize = window[0];
+    if (window[1] != ARQ_SELECTIVE_REPEAT) agreed->arq = LlGoBackN;
+    if (agreed->arq == LlSelectiveRepeat && agreed->windowSize > MAX_SR_WINDOW_SIZE)
+        agreed->windowSize = MAX_SR_WINDOW_SIZE;
+}
+
+// The smaller of two payload sizes
+static void agreeFrameSize(Capabilities *agreed, const unsigned char *frameSize)
+{
+    int size = frameSize[0] << 8 | frameSize[1];
+    agreed->maxPayload = (size >= 1 && size < offer.maxPayload) ? size : offer.maxPayload;
+}
+
+// Transmitter: SET, offering the frame checks and encodings we support
+// unless plain is set (for peers that only take the bare SET).
+// Returns the number of bytes written.
+static int sendSET(int plain)
+{
+    if (plain)
+    {
+        sendSupervisionFrame(A_TX, C_SET);
+        return 5;
+    }
+
+    unsigned char checks = CHECK_BCC2;
+    if (offer.check == LlCheckCrc32c) checks |= CHECK_CRC32C;
+    unsigned char framings = FRAMING_STUFFING;
+    if (offer.framing == LlFramingCobs) framings |= FRAMING_COBS;
+
+    unsigned char fecs = offer.fec ? FEC_RS : 0;
+    unsigned char compressions = offer.compression ? COMPRESSION_LZ : 0;
+    unsigned char aggregations = offer.aggregation ? AGGREGATION_LENGTH_PREFIX : 0;
+    unsigned char flowControls = offer.rnr ? FLOW_RNR : 0;
+    unsigned char piggybacks = offer.piggyback ? PIGGYBACK_SET | PIGGYBACK_DISC : 0;
+    unsigned char resyncs = offer.resync ? RESYNC_SEQUENCE : 0;
+    unsigned char arq = (offer.arq == LlSelectiveRepeat) ? ARQ_SELECTIVE_REPEAT : ARQ_GO_BACK_N;
+
+    unsigned char capabilities[] = {CAP_CHECK, 1, checks, CAP_FRAMING, 1, framings, CAP_FEC, 1, fecs,
+                                            CAP_WINDOW, 2, offer.windowSize, arq,
+                                            CAP_FRAME_SIZE, 2, offer.maxPayload >> 8, offer.maxPayload & 0xFF,
+                                            CAP_COMPRESSION, 1, compressions, CAP_AGGREGATION, 1, aggregations,
+                                            CAP_FLOW_CONTROL, 1, flowControls, CAP_PIGGYBACK, 1, piggybacks,
+                                            CAP_RESYNC, 1, resyncs};
+
+    // The first packet goes with it
+    unsigned char info[sizeof(capabilities) + 2 + MAX_PIGGYBACK_SIZE];
+    int size = sizeof(capabilities);
+    memcpy(info, capabilities, size);
+    if (offer.piggyback) size += putPacket(&info[size], openPacket, openPacketSize);
+    return sendUnnumberedFrame(A_TX, C_SET, info, size);
+}
+
+// Transmitter: take what the receiver chose (nothing from a plain UA, and
+// what peers without them get for the capabilities it leaves out)
+static void acceptUA(const FrameEvent *event)
+{
+    int check = findCapability(event->data, event->dataSize, CAP_CHECK);
+    int encoding = findCapability(event->data, event->dataSize, CAP_FRAMING);
+    int fec = findCapability(event->data, event->dataSize, CAP_FEC);
+    int compression = findCapability(event->data, event->dataSize, CAP_COMPRESSION);
+    int aggregation = findCapability(event->data, event->dataSize, CAP_AGGREGATION);
+    int flowControl = findCapability(event->data, event->dataSize, CAP_FLOW_CONTROL);
+    int piggyback = findCapability(event->data, event->dataSize, CAP_PIGGYBACK);
+    int resync = findCapability(event->data, event->dataSize, CAP_RESYNC);
+    const unsigned char *window = findCapabilityValue(event->data, event->dataSize, CAP_WINDOW, 2);
+    const unsigned char *frameSize = findCapabilityValue(event->data, event->dataSize, CAP_FRAME_SIZE, 2);
+
+    Capabilities agreed = legacyCapabilities(check >= 0);
+    agreed.check = (check == CHECK_CRC32C) ? LlCheckCrc32c : LlCheckBcc2;
+    agreed.framing = (encoding == FRAMING_COBS) ? LlFramingCobs : LlFramingStuffing;
+    agreed.fec = (fec == FEC_RS && offer.fec);
+    agreed.compression = (compression == COMPRESSION_LZ && offer.compression);
+    agreed.aggregation = (aggregation == AGGREGATION_LENGTH_PREFIX && offer.aggregation);
+    agreed.rnr = (flowControl == FLOW_RNR && offer.rnr);
+    agreed.piggyback = (piggyback >= 0 && (piggyback & PIGGYBACK_DISC) && offer.piggyback);
+    agreed.resync = (resync == RESYNC_SEQUENCE && offer.resync);
+    if (window) agreeWindow(&agreed, window);
+    if (frameSize) agreeFrameSize(&agreed, frameSize);
+    setCapabilities(agreed);
+    openPacketTaken = (piggyback >= 0 && (piggyback & PIGGYBACK_SET));
+
+    const unsigned char *packet;
+    int packetSize = findPacket(event, &packet);
+    answerPacketSize = (agreed.piggyback && packetSize > 0) ? packetSize : 0;
+    if (answerPacketSize > 0) memcpy(answerPacket, packet, answerPacketSize);
+}
+
+static void enqueuePacket(const unsigned char *packet, int packetSize);
+
+// Receiver: nothing taken yet, the next frame expected is Ns=0
+static void resetReceiver()
+{
+    expectedNs = 0;
+    rejSent = FALSE;
+    framesUnacked = 0;
+    rxQueueHead = rxQueueCount = 0;
+    rxQueueTaken = FALSE;
+    rnrSent = FALSE;
+    openPacketTaken = FALSE;
+    sessionStarted = FALSE;
+    for (int ns = 0; ns < SEQ_MODULUS_EXT; ns++)
+    {
+        rxWindow[ns].present = rxWindow[ns].srejSent = FALSE;
+        harqWindow[ns].count = harqWindow[ns].next = 0;
+    }
+    discReceived = FALSE;
+}
+
+// Receiver: pick the frame check, encoding, window and so on from the SET
+// (a plain SET keeps what an earlier one agreed on) and answer with UA.
+// Each side only gets what both asked for. A SET once the session is under
+// way comes from a transmitter that started over (restarted, or gave up on
+// it): what is left of the old session goes, the new one starts from Ns=0.
+static void answerSET(const FrameEvent *event)
+{
+    int checks = findCapability(event->data, event->dataSize, CAP_CHECK);
+    int framings = findCapability(event->data, event->dataSize, CAP_FRAMING);
+    int fecs = findCapability(event->data, event->dataSize, CAP_FEC);
+    int compressions = findCapability(event->data, event->dataSize, CAP_COMPRESSION);
+    int aggregations = findCapability(event->data, event->dataSize, CAP_AGGREGATION);
+    int flowControls = findCapability(event->data, event->dataSize, CAP_FLOW_CONTROL);
+    int piggybacks = findCapability(event->data, event->dataSize, CAP_PIGGYBACK);
+    int resyncs = findCapability(event->data, event->dataSize, CAP_RESYNC);
+    const unsigned char *window = findCapabilityValue(event->data, event->dataSize, CAP_WINDOW, 2);
+    const unsigned char *frameSize = findCapabilityValue(event->data, event->dataSize, CAP_FRAME_SIZE, 2);
+    const unsigned char *oldest = findCapabilityValue(event->data, event->dataSize, CAP_SEQUENCE, 1);
+
+    // A transmitter back from a line that was down: the connection goes on
+    // as it was, from the next frame expected
+    if (oldest && resyncEnabled)
+    {
+        framesUnacked = 0;
+        stopTimer(ackTimerFd);
+        unsigned char info[] = {CAP_SEQUENCE, 1, expectedNs};
+        sendUnnumberedFrame(A_RX, C_UA, info, sizeof(info));
+        printf("[llread] Resync SET (oldest frame Ns=%d) -> UA, expecting Ns=%d\n", oldest[0], expectedNs);
+        return;
+    }
+
+    if (sessionStarted)
+    {
+        printf("[llread] SET from a new session -> %d frame(s) not read dropped\n", rxQueueCount);
+        stopTimer(ackTimerFd);
+        resetReceiver();
+        setCapabilities(legacyCapabilities(FALSE));
+        capabilitiesSeen = FALSE;
+    }
+
+    if (checks >= 0)
+    {
+        capabilitiesSeen = TRUE;
+        Capabilities agreed = legacyCapabilities(TRUE);
+        agreed.check = ((checks & CHECK_CRC32C) && offer.check == LlCheckCrc32c) ? LlCheckCrc32c : LlCheckBcc2;
+        agreed.framing = (framings >= 0 && (framings & FRAMING_COBS) && offer.framing == LlFramingCobs)
+                                     ? LlFramingCobs
+                                     : LlFramingStuffing;
+        agreed.fec = (fecs >= 0 && (fecs & FEC_RS) && offer.fec);
+        agreed.compression = (compressions >= 0 && (compressions & COMPRESSION_LZ) && offer.compression);
+        agreed.aggregation = (aggregations >= 0 && (aggregations & AGGREGATION_LENGTH_PREFIX) && offer.aggregation);
+        agreed.rnr = (flowControls >= 0 && (flowControls & FLOW_RNR) && offer.rnr);
+        agreed.piggyback = (piggybacks >= 0 && (piggybacks & PIGGYBACK_DISC) && offer.piggyback);
+        agreed.resync = (resyncs >= 0 && (resyncs & RESYNC_SEQUENCE) && offer.resync);
+        if (window) agreeWindow(&agreed, window);
+        if (frameSize) agreeFrameSize(&agreed, frameSize);
+        setCapabilities(agreed);
+
+        // The application gets the packet in the SET first, however many
+        // times the SET comes
+        const unsigned char *packet;
+        int packetSize = findPacket(event, &packet);
+        if (offer.piggyback && !openPacketTaken && packetSize > 0)
+        {
+            enqueuePacket(packet, packetSize);
+            openPacketTaken = TRUE;
+            printf("[llopen - RX] Packet of %d bytes taken from the SET\n", packetSize);
+        }
+    }
+
+    if (!capabilitiesSeen)
+    {
+        sendSupervisionFrame(A_RX, C_UA);
+        return;
+    }
+
+    unsigned char capabilities[] = {CAP_CHECK, 1, (frameCheck == LlCheckCrc32c) ? CHECK_CRC32C : CHECK_BCC2,
+                                    CAP_FRAMING, 1, (framing == LlFramingCobs) ? FRAMING_COBS : FRAMING_STUFFING,
+                                    CAP_FEC, 1, fecEnabled ? FEC_RS : 0,
+                                    CAP_WINDOW, 2, connection.windowSize,
+                                    (connection.arq == LlSelectiveRepeat) ? ARQ_SELECTIVE_REPEAT : ARQ_GO_BACK_N,
+                                    CAP_FRAME_SIZE, 2, maxPayload >> 8, maxPayload & 0xFF,
+                                    CAP_COMPRESSION, 1, compressionEnabled ? COMPRESSION_LZ : 0,
+                                    CAP_AGGREGATION, 1, aggregationEnabled ? AGGREGATION_LENGTH_PREFIX : 0,
+                                    CAP_FLOW_CONTROL, 1, rnrEnabled ? FLOW_RNR : 0,
+                                    CAP_PIGGYBACK, 1, (piggybackEnabled ? PIGGYBACK_DISC : 0) | (openPacketTaken ? PIGGYBACK_SET : 0),
+                                    CAP_RESYNC, 1, resyncEnabled ? RESYNC_SEQUENCE : 0};
+
+    // The receiver's packet for llopenWith() goes with it
+    unsigned char info[sizeof(capabilities) + 2 + MAX_PIGGYBACK_SIZE];
+    int size = sizeof(capabilities);
+    memcpy(info, capabilities, size);
+    if (piggybackEnabled) size += putPacket(&info[size], openPacket, openPacketSize);
+    sendUnnumberedFrame(A_RX, C_UA, info, size);
+}
+
+////////////////////////////////////////////////
+// Simple helpers to send RR/RNR, REJ and SREJ frames
+////////////////////////////////////////////////
+
+// The application is behind when it leaves more than RX_QUEUE_SPARE payloads
+// in the queue, and caught up again at half that
+static int receiverBusy()
+{
+    if (!rnrEnabled) return FALSE;
+    return rxQueueCount > (rnrSent ? RX_QUEUE_SPARE / 2 : RX_QUEUE_SPARE);
+}
+
+// RR, or RNR while the application is behind
+static void sendAck(int expectedNs)
+{
+    int busy = receiverBusy();
+    sendNumberedSupervisionFrame(A_RX, busy ? C_RNRX : C_RRX, expectedNs);
+    framesUnacked = 0;
+    stopTimer(ackTimerFd);
+    if (busy && !rnrSent) stats.rnrSent++;
+    if (!busy) stats.rrSent++;
+    rnrSent = busy;
+    printf("[llread] Sent %s(%d)\n", busy ? "RNR" : "RR", expectedNs);
+}
+
+// REJ acknowledges the frames before expectedNs too
+static void sendREJ(int expectedNs)
+{
+    sendNumberedSupervisionFrame(A_RX, C_REJX, expectedNs);
+    framesUnacked = 0;
+    stopTimer(ackTimerFd);
+    stats.rejSent++;
+    printf("[llread] Sent REJ(%d)\n", expectedNs);
+}
+
+static void sendSREJ(int ns)
+{
+    sendNumberedSupervisionFrame(A_RX, C_SREJX, ns);
+    stats.srejSent++;
+    printf("[llread] Sent SREJ(%d)\n", ns);
+}
+
+// Delayed acknowledgement: frames taken in sequence are acknowledged every
+// ackEvery frames or ackDelayMs after the first of them, whichever comes
+// first. At most half the window waits, so the transmitter never stalls
+// on a full window for the timer.
+static int ackEvery()
+{
+    int every = connection.ackEvery;
+    if (every > (connection.windowSize + 1) / 2) every = (connection.windowSize + 1) / 2;
+    return (every > 1) ? every : 1;
+}
+
+static void acknowledgeInSequence(int immediate)
+{
+    if (immediate || receiverBusy() || ++framesUnacked >= ackEvery())
+        sendAck(expectedNs);
+    else if (framesUnacked == 1)
+        armTimer(ackTimerFd, connection.ackDelayMs);
+}
+
+// Acknowledge now what is waiting for the timer
+static void flushAck()
+{
+    if (framesUnacked > 0) sendAck(expectedNs);
+}
+
+// The rest of a frame is on its way: give it time to pile up in the driver
+// so that one read() returns many bytes instead of one
+static void batchDelay()
+{
+    double ms = RX_BATCH_BYTES * byteTimeMs();
+    if (ms > RX_BATCH_MAX_MS) ms = RX_BATCH_MAX_MS;
+
+    struct timespec ts = {0, (long)(ms * 1e6)};
+    nanosleep(&ts, NULL);
+}
+
+////////////////////////////////////////////////
+// Read the next frame into *event (its data stays valid until the next call).
+// Returns 1 on a frame, 0 if block is FALSE and no complete frame is available
+// yet, or -1 if a timer expired first.
+////////////////////////////////////////////////
+static int nextFrame(FrameEvent *event, int block)
+{
+    const unsigned char *bytes;
+
+    while (1)
+    {
+        int available = peekSerialPort(&bytes);
+        if (available <= 0)
+        {
+            if (available < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                perror("[readFrame] Read failed");
+                return -1;
+            }
+
+            // Nothing buffered: sleep until more bytes arrive or a timer fires
+            if (waitForEvents(block)) return -1;
+            if (!block) return 0;
+            if (parserInFrame(&parser)) batchDelay();
+            continue;
+        }
+
+        consumeSerialPort(parserFeed(&parser, bytes, available, event));
+        if (event->type != FRAME_NONE) return 1;
+    }
+}
+
+// A frame of this type, from this address, that arrived intact
+static int isFrame(const FrameEvent *event, FrameType type, unsigned char address)
+{
+    return event->valid && event->type == type && event->address == address;
+}
+
+////////////////////////////////////////////////
+// Timers and round-trip estimation
+////////////////////////////////////////////////
+// Account for nBytes written now; returns the ms until they are all sent
+static double queueOnLine(int nBytes)
+{
+    double now = nowMs();
+    if (lineFreeAt < now) lineFreeAt = now;
+    lineFreeAt += nBytes * byteTimeMs();
+    return lineFreeAt - now;
+}
+
+static void updateRto(double sample)
+{
+    if (sample < 0) sample = 0;
+
+    if (srtt < 0)
+    {
+        srtt = sample;
+        rttvar = sample / 2;
+    }
+    else
+    {
+        double err = srtt - sample;
+        rttvar = 0.75 * rttvar + 0.25 * (err < 0 ? -err : err);
+        srtt = 0.875 * srtt + 0.125 * sample;
+    }
+
+    rto = srtt + ((4 * rttvar > 1.0) ? 4 * rttvar : 1.0);
+    if (rto < RTO_MIN_MS) rto = RTO_MIN_MS;
+    if (rto > RTO_MAX_MS) rto = RTO_MAX_MS;
+}
+
+// Exponential backoff (Karn); kept until a frame sent once is acknowledged
+static void backoffRto()
+{
+    rto *= 2;
+    if (rto > RTO_MAX_MS) rto = RTO_MAX_MS;
+}
+
+////////////////////////////////////////////////
+// Adaptive FEC (transmitter)
+////////////////////////////////////////////////
+// A frame was sent: raise the level as soon as the window has too many
+// retransmissions, lower it at the end of enough clean windows
+static void fecAdapt(int retransmission)
+{
+    if (!fecEnabled || connection.fec != LlFecAdaptive) return;
+
+    if (retransmission) fecWindow.retransmissions++;
+    fecWindow.frames++;
+
+    if (fecWindow.retransmissions > FEC_RAISE_RATE * FEC_WINDOW && fecLevel < FEC_LEVELS - 1)
+    {
+        fecLevel++;
+        fecWindow.cleanWindows = 0;
+        fecWindow.cleanNeeded *= 2;
+        if (fecWindow.cleanNeeded > FEC_MAX_CLEAN_WINDOWS) fecWindow.cleanNeeded = FEC_MAX_CLEAN_WINDOWS;
+        stats.fecRaised++;
+        printf("[llwrite] %d retransmissions in %d frames -> FEC parity %d\n", fecWindow.retransmissions,
+               fecWindow.frames, fecParity(fecLevel));
+    }
+    else if (fecWindow.frames < FEC_WINDOW)
+        return;
+    else if (fecWindow.retransmissions > 0)
+        fecWindow.cleanWindows = 0;
+    else if (++fecWindow.cleanWindows >= fecWindow.cleanNeeded && fecLevel > 0)
+    {
+        fecLevel--;
+        fecWindow.cleanWindows = 0;
+        stats.fecLowered++;
+        printf("[llwrite] No retransmissions -> FEC parity %d\n", fecParity(fecLevel));
+    }
+
+    fecWindow.frames = 0;
+    fecWindow.retransmissions = 0;
+}
+
+////////////////////////////////////////////////
+// Adaptive payload size (transmitter)
+////////////////////////////////////////////////
+static long integerSqrt(long x)
+{
+    long root = x;
+    if (root < 2) return root;
+    for (long next = (root + x / root) / 2; next < root; next = (root + x / root) / 2)
+        root = next;
+    return root;
+}
+
+// Best frame size on the line: throughput goes with
+// L / (L + h) * exp(-lossPerByte (L + h)), which peaks where
+// L (L + h) = h / lossPerByte
+static long bestWireSize()
+{
+    double h = SIZE_FRAME_OVERHEAD;
+    return (integerSqrt((long)(h * h + 4 * h / lossPerByte)) - SIZE_FRAME_OVERHEAD) / 2;
+}
+
+// A new frame was sent: at the end of each window, double the payload size
+// if no frame failed (and halve the loss estimate), otherwise average the
+// loss rate seen into the estimate and take the best size for it (at most
+// double the current one too)
+static void sizeAdapt(int wireBytes, int payloadBytes)
+{
+    if (!connection.adaptiveFrameSize) return;
+
+    sizeWindow.frames++;
+    sizeWindow.wireBytes += wireBytes;
+    sizeWindow.payloadBytes += payloadBytes;
+    if (sizeWindow.frames < SIZE_WINDOW) return;
+
+    long target = 2L * payloadTarget;
+    if (sizeWindow.errors == 0)
+        lossPerByte /= 2;
+    else
+    {
+        double f = (double)sizeWindow.errors / sizeWindow.frames;
+        if (f > 0.5) f = 0.5;
+        double loss = f * (1 + f / 2 + f * f / 3) * sizeWindow.frames / sizeWindow.wireBytes; // -ln(1 - f) per byte
+        lossPerByte = (lossPerByte > 0) ? (lossPerByte + loss) / 2 : loss;
+
+        // Payload for that frame size, by the compression and stuffing seen
+        long best = bestWireSize() * sizeWindow.payloadBytes / sizeWindow.wireBytes;
+        if (best < target) target = best;
+    }
+    if (target > maxPayload) target = maxPayload;
+    if (target < SIZE_MIN_PAYLOAD) target = SIZE_MIN_PAYLOAD;
+
+    if (target != payloadTarget)
+    {
+        printf("[llwrite] %d errors in %d frames -> payload size %ld\n", sizeWindow.errors, sizeWindow.frames, target);
+        if (target > payloadTarget) stats.sizeGrown++;
+        else stats.sizeShrunk++;
+        payloadTarget = target;
+        if (target < stats.sizeSmallest) stats.sizeSmallest = target;
+        if (target > stats.sizeLargest) stats.sizeLargest = target;
+    }
+    memset(&sizeWindow, 0, sizeof(sizeWindow));
+}
+
+////////////////////////////////////////////////
+// Sender window helpers
+////////////////////////////////////////////////
+static int outstandingFrames()
+{
+    return (sequenceNumber - txBase + modulus) % modulus;
+}
+
+// Every frame in flight has its own timer, armed on each (re)transmission
+static int sendWindowFrame(int ns)
+{
+    TxFrame *tx = &txWindow[ns];
+
+    if (writeAll(tx->frame, tx->size) < 0)
+    {
+        perror("[llwrite] Write failed");
+        return -1;
+    }
+    tx->sentAt = nowMs();
+    tx->wireTime = queueOnLine(tx->size);
+    tx->expired = FALSE;
+    if (armTimer(tx->timerFd, tx->wireTime + rto) < 0)
+    {
+        perror("[llwrite] Frame timer");
+        return -1;
+    }
+    stats.framesSent++;
+    return 0;
+}
+
+static int encodeFrame(int ns, const unsigned char *buf, int bufSize);
+
+// Retransmit a single frame, with more FEC if the level went up since
+static int resendFrame(int ns)
+{
+    TxFrame *tx = &txWindow[ns];
+    fecAdapt(TRUE);
+    if (fecEnabled && tx->fecLevel < fecLevel)
+    {
+        if (encodeFrame(ns, &tx->field[1], tx->payloadSize) < 0) return -1;
+        stats.fecReencoded++;
+    }
+
+    if (sendWindowFrame(ns) < 0) return -1;
+    txWindow[ns].retransmitted = TRUE;
+    stats.retransmissions++;
+    printf("[llwrite] Resent I frame Ns=%d\n", ns);
+    return 0;
+}
+
+// Go-Back-N: retransmit every unacknowledged frame, oldest first
+static int goBackN()
+{
+    for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+    {
+        if (resendFrame(ns) < 0) return -1;
+    }
+    return 0;
+}
+
+static int inWindow(int ns)
+{
+    return (ns - txBase + modulus) % modulus < outstandingFrames();
+}
+
+static int resynchronise();
+
+// On timeout, Go-Back-N resends the whole window while Selective Repeat
+// only resends the frames whose own timer expired.
+// Returns -1 once a frame has used up its nRetransmissions attempts and the
+// line did not come back.
+static int handleTimeouts()
+{
+    for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+    {
+        TxFrame *tx = &txWindow[ns];
+        if (!tx->expired) continue;
+
+        tx->expired = FALSE;
+        tx->retries++;
+        stats.timeouts++;
+        // Later ones may only be held up behind it (and backing off for each
+        // of them would take the RTO to its limit in a single outage)
+        if (ns == txBase)
+        {
+            sizeWindow.errors++;
+            backoffRto();
+        }
+        printf("[llwrite] Timeout Ns=%d, retry %d/%d (RTO %.1f ms)\n", ns, tx->retries, connection.nRetransmissions, rto);
+        if (tx->retries >= connection.nRetransmissions) return resynchronise();
+
+        if (!isSelectiveRepeat()) return goBackN();
+        if (resendFrame(ns) < 0) return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// Transmitter flow control. After RNR nothing is sent or retransmitted
+// (the frames in flight are not lost, their timers are stopped) and the
+// receiver is polled with RR until it answers RR. Only polls that get no
+// answer at all count against nRetransmissions.
+////////////////////////////////////////////////
+static void pauseTransmission()
+{
+    for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+    {
+        stopTimer(txWindow[ns].timerFd);
+        txWindow[ns].expired = FALSE;
+    }
+    peerBusy = TRUE;
+    pausedSince = nowMs();
+    pollInterval = rto;
+    controlExpired = FALSE;
+    armTimer(controlTimerFd, pollInterval);
+    stats.rnrReceived++;
+}
+
+static int pollReceiver()
+{
+    controlExpired = FALSE;
+    if (++pollsUnanswered > connection.nRetransmissions) return resynchronise();
+
+    sendNumberedSupervisionFrame(A_TX, C_RRX, sequenceNumber);
+    stats.polls++;
+    printf("[llwrite] Receiver busy, polled (next in %.0f ms)\n", pollInterval);
+    if (armTimer(controlTimerFd, pollInterval) < 0) return -1;
+    pollInterval = (pollInterval * 2 > POLL_MAX_MS) ? POLL_MAX_MS : pollInterval * 2;
+    return 0;
+}
+
+// Whatever the receiver could not take while busy is sent again, without
+// counting as an error on the line
+static int resumeTransmission()
+{
+    peerBusy = FALSE;
+    stopTimer(controlTimerFd);
+    controlExpired = FALSE;
+    stats.pausedMs += nowMs() - pausedSince;
+
+    for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+    {
+        if (sendWindowFrame(ns) < 0) return -1;
+        txWindow[ns].retransmitted = TRUE;
+        stats.retransmissions++;
+    }
+    return 0;
+}
+
+// Cumulative acknowledgement: N(R) = nr acknowledges every frame before nr.
+// Returns FALSE if nr is outside the window.
+static int acknowledge(int nr)
+{
+    int acked = (nr - txBase + modulus) % modulus;
+    if (acked > outstandingFrames()) return FALSE;
+
+    if (acked > 0)
+    {
+        // The oldest acknowledged frame gives the RTT sample: it waited
+        // longest for a receiver that delays its RRs, and its timer with it
+        TxFrame *oldest = &txWindow[txBase];
+        if (!oldest->retransmitted)
+            updateRto(nowMs() - oldest->sentAt - oldest->wireTime);
+
+        for (int ns = txBase; ns != nr; ns = (ns + 1) % modulus)
+        {
+            stopTimer(txWindow[ns].timerFd);
+            txWindow[ns].expired = FALSE;
+        }
+        txBase = nr;
+    }
+    return TRUE;
+}
+
+// Transmitter, line down: N(R) in the receiver's answer to a probe, or -1
+// if the event is none
+static int probeAnswer(const FrameEvent *event)
+{
+    if (resyncEnabled)
+    {
+        const unsigned char *nr = isFrame(event, FRAME_UA, A_RX)
+                                      ? findCapabilityValue(event->data, event->dataSize, CAP_SEQUENCE, 1)
+                                      : NULL;
+        return nr ? nr[0] : -1;
+    }
+
+    if (!event->headerValid || !event->valid || event->address != A_RX) return -1;
+    if (event->type == FRAME_RR || event->type == FRAME_RNR || event->type == FRAME_REJ) return event->n;
+    return (event->type == FRAME_SREJ) ? txBase : -1;
+}
+
+////////////////////////////////////////////////
+// Link down (transmitter). Nothing goes out but a probe, at the RTO and
+// then backing off, until the receiver answers it: a resync SET naming the
+// oldest frame not acknowledged, answered by a UA naming the next frame
+// expected, or for receivers without resync that oldest frame itself. The
+// connection then goes on as it was: everything not acknowledged is sent
+// again, each frame with its nRetransmissions attempts back.
+// Returns 0 once the line is back, -1 if it is not within outageTimeout
+// seconds.
+////////////////////////////////////////////////
+static int resynchronise()
+{
+    if (connection.outageTimeout <= 0 || (!resyncEnabled && outstandingFrames() == 0)) return -1;
+
+    double downSince = nowMs();
+    double deadline = downSince + connection.outageTimeout * 1000.0;
+    double interval = (rto < RESYNC_MAX_MS) ? rto : RESYNC_MAX_MS;
+    FrameEvent event;
+
+    // Answers to what was sent before are no RTT samples
+    for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+    {
+        stopTimer(txWindow[ns].timerFd);
+        txWindow[ns].expired = FALSE;
+        txWindow[ns].retransmitted = TRUE;
+    }
+    if (peerBusy) stats.pausedMs += downSince - pausedSince;
+    peerBusy = FALSE;
+    pollsUnanswered = 0;
+    stats.outages++;
+    printf("[llwrite] Line down, probing for up to %d s%s\n", connection.outageTimeout,
+           resyncEnabled ? "" : " (with the oldest frame)");
+
+    while (nowMs() < deadline)
+    {
+        unsigned char info[] = {CAP_SEQUENCE, 1, txBase};
+        if (resyncEnabled)
+            sendUnnumberedFrame(A_TX, C_SET, info, sizeof(info));
+        else if (sendWindowFrame(txBase) < 0)
+            return -1;
+        stopTimer(txWindow[txBase].timerFd);
+        stats.resyncProbes++;
+
+        controlExpired = FALSE;
+        if (armTimer(controlTimerFd, (deadline - nowMs() < interval) ? deadline - nowMs() : interval) < 0) return -1;
+        interval = (interval * 2 > RESYNC_MAX_MS) ? RESYNC_MAX_MS : interval * 2;
+
+        while (!controlExpired)
+        {
+            // Anything else is left over from before
+            if (nextFrame(&event, TRUE) <= 0) continue;
+            int nr = probeAnswer(&event);
+            if (nr < 0 || !acknowledge(nr)) continue;
+
+            stopTimer(controlTimerFd);
+            controlExpired = FALSE;
+            stats.outageMs += nowMs() - downSince;
+            printf("[llwrite] Line back after %.1f s, receiver expects Ns=%d\n", (nowMs() - downSince) / 1000, nr);
+
+            for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+            {
+                txWindow[ns].retries = 0;
+                if (sendWindowFrame(ns) < 0) return -1;
+                stats.retransmissions++;
+            }
+            return 0;
+        }
+    }
+
+    printf("[llwrite] Line still down after %d s\n", connection.outageTimeout);
+    return -1;
+}
+
+////////////////////////////////////////////////
+// Transmitter: process an RR/RNR/REJ/SREJ. A frame rejected nRetransmissions
+// times goes through resynchronise(), as one that timed out that often.
+// Returns 0, or -1 if the receiver did not answer within outageTimeout.
+////////////////////////////////////////////////
+static int handleAck(const FrameEvent *event)
+{
+    int nr = event->n;
+
+    if (event->type == FRAME_RR || event->type == FRAME_RNR) pollsUnanswered = 0;
+
+    if (event->type == FRAME_RNR)
+    {
+        if (!acknowledge(nr)) return 0;
+
+        printf("[llwrite] RNR(%d) received -> %d frame(s) outstanding, paused\n", nr, outstandingFrames());
+        if (!peerBusy) pauseTransmission();
+    }
+    else if (event->type == FRAME_RR)
+    {
+        if (!acknowledge(nr)) return 0;
+
+        printf("[llwrite] RR(%d) received -> %d frame(s) outstanding\n", nr, outstandingFrames());
+        if (peerBusy) return resumeTransmission();
+    }
+    else if (peerBusy)
+    {
+        // Everything outstanding goes again on resuming
+        return 0;
+    }
+    else if (event->type == FRAME_REJ)
+    {
+        if (!acknowledge(nr) || outstandingFrames() == 0) return 0;
+
+        printf("[llwrite] REJ(%d) received -> retransmit\n", nr);
+        sizeWindow.errors++;
+        if (++txWindow[txBase].retries >= connection.nRetransmissions) return resynchronise();
+        if (goBackN() < 0) return -1;
+    }
+    else if (inWindow(nr))
+    {
+        printf("[llwrite] SREJ(%d) received -> retransmit\n", nr);
+        sizeWindow.errors++;
+        if (resendFrame(nr) < 0) return -1;
+    }
+    return 0;
+}
+
+static int dispatchFrame(FrameEvent *event);
+
+static int flushBatch();
+
+////////////////////////////////////////////////
+// Process incoming frames until at most maxOutstanding frames are
+// unacknowledged, then drain the acknowledgements already received.
+// Held back packets go out as soon as they have waited aggregationDelayMs.
+// Returns 0 on success or -1 once nRetransmissions attempts have failed.
+////////////////////////////////////////////////
+static int waitForAcks(int maxOutstanding)
+{
+    FrameEvent event;
+
+    while (1)
+    {
+        if (batchExpired && flushBatch() < 0) return -1;
+        if (peerBusy && controlExpired && pollReceiver() < 0) return -1;
+        if (handleTimeouts() < 0) return -1;
+
+        int block = peerBusy || outstandingFrames() > maxOutstanding;
+        int got = nextFrame(&event, block);
+        if (got == 0) return 0;
+        if (got < 0) continue;
+
+        if (dispatchFrame(&event) < 0) return -1;
+    }
+}
+
+// Give up on the connection: tell the receiver we are leaving
+static int giveUp()
+{
+    for (int ns = txBase; ns != sequenceNumber; ns = (ns + 1) % modulus)
+        stopTimer(txWindow[ns].timerFd);
+    printf("[llwrite] Transmission failed after retries\n");
+
+    sendSupervisionFrame(A_TX, C_DISC);
+    return -1;
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+int llopen(LinkLayer connectionParameters)
+{
+    connection = connectionParameters;
+
+    // Until the handshake gives a first sample, the configured timeout is the RTO
+    srtt = -1;
+    rttvar = 0;
+    rto = connection.timeout * 1000.0;
+    lineFreeAt = 0;
+    answerPacketSize = 0;
+
+    if (connection.windowSize < 1) connection.windowSize = 1;
+    if (connection.windowSize > MAX_WINDOW_SIZE) connection.windowSize = MAX_WINDOW_SIZE;
+    if (connection.arq == LlSelectiveRepeat && connection.windowSize > MAX_SR_WINDOW_SIZE)
+        connection.windowSize = MAX_SR_WINDOW_SIZE;
+    if (connection.maxPayload < 1) connection.maxPayload = MAX_PAYLOAD_SIZE;
+    if (connection.maxPayload > MAX_LARGE_PAYLOAD_SIZE) connection.maxPayload = MAX_LARGE_PAYLOAD_SIZE;
+    modulus = (connection.windowSize > 1) ? SEQ_MODULUS_EXT : 2;
+    offer = (Capabilities){connection.check, connection.framing, connection.fec != LlFecOff, connection.windowSize,
+                           connection.arq, connection.maxPayload, connection.compression != LlCompressionOff,
+                           connection.aggregation && !connection.simplex, !connection.simplex,
+                           connection.piggyback && !connection.simplex, !connection.simplex};
+
+    txBase = 0;
+    sequenceNumber = 0;
+    peerBusy = FALSE;
+    pollsUnanswered = 0;
+    resetReceiver();
+    if (allocateBuffers() < 0)
+    {
+        perror("Error allocating frame buffers");
+        return -1;
+    }
+    parserReset(&parser);
+    memset(&stats, 0, sizeof(stats));
+    setCapabilities(legacyCapabilities(FALSE));
+    capabilitiesSeen = FALSE;
+
+    serialFd = openSerialPort(connection.serialPort, connection.baudRate);
+    if (serialFd < 0)
+    {
+        perror("Error opening serial port");
+        freeBuffers();
+        return -1;
+    }
+
+    if (openEngine() < 0)
+    {
+        perror("Error setting up the link event loop");
+        closeEngine();
+        closeSerialPort();
+        freeBuffers();
+        return -1;
+    }
+
+    // One-way link: nothing to agree on and nobody to answer
+    if (connection.simplex)
+    {
+        setCapabilities(offer);
+        printf("[llopen - %s] One-way link (%d byte payloads, %s, %s%s%s)\n", connection.role == LlTx ? "TX" : "RX",
+               maxPayload, frameCheck == LlCheckCrc32c ? "CRC-32C" : "BCC2",
+               framing == LlFramingCobs ? "COBS" : "byte stuffing",
+               fecEnabled ? ", Reed-Solomon FEC" : "", compressionEnabled ? ", LZ compression" : "");
+        return 0;
+    }
+
+    FrameEvent event;
+
+    if (connection.role == LlTx)
+    {
+        // Transmitter. Peers that predate capabilities drop a SET with an
+        // information field, so every third attempt is a plain SET; not every
+        // other one, or a single SET lost to noise would settle for no
+        // capabilities on the lines that need them most.
+        for (int attempt = 1; attempt <= connection.nRetransmissions; attempt++)
+        {
+            int plain = (attempt % 3 == 0);
+            int setSize = sendSET(plain);
+            printf("[llopen - TX] SET frame sent%s\n", plain ? " (plain)" : "");
+
+            double sentAt = nowMs();
+            controlExpired = FALSE;
+            if (armTimer(controlTimerFd, rto) < 0) break;
+
+            while (!controlExpired)
+            {
+                if (nextFrame(&event, TRUE) <= 0) continue;
+                dispatchFrame(&event);
+
+                if (isFrame(&event, FRAME_UA, A_RX))
+                {
+                    stopTimer(controlTimerFd);
+
+                    // SET + UA round trip (Karn: only if SET was sent once)
+                    if (attempt == 1)
+                        updateRto(nowMs() - sentAt - setSize * byteTimeMs());
+
+                    acceptUA(&event);
+                    printf("[llopen - TX] UA received (window %d, %s, %d byte payloads, %s, %s%s%s%s)\n",
+                           connection.windowSize, isSelectiveRepeat() ? "selective repeat" : "go-back-n", maxPayload,
+                           frameCheck == LlCheckCrc32c ? "CRC-32C" : "BCC2",
+                           framing == LlFramingCobs ? "COBS" : "byte stuffing",
+                           fecEnabled ? ", Reed-Solomon FEC" : "", compressionEnabled ? ", LZ compression" : "",
+                           aggregationEnabled ? ", packet aggregation" : "");
+                    return 0;
+                }
+            }
+
+            printf("[llopen - TX] Timeout %d/%d\n", attempt, connection.nRetransmissions);
+        }
+
+        printf("[llopen - TX] Connection failed\n");
+        closeEngine();
+        closeSerialPort();
+        freeBuffers();
+        return -1;
+    }
+    else
+    {
+        // Receiver
+        printf("[llopen - RX] Waiting for SET...\n");
+        while (1)
+        {
+            if (nextFrame(&event, TRUE) <= 0) continue;
+            dispatchFrame(&event); // answers SET with UA
+
+            if (isFrame(&event, FRAME_SET, A_TX))
+            {
+                printf("[llopen - RX] SET received, UA sent\n");
+                return 0;
+            }
+        }
+    }
+}
+
+int llopenWith(LinkLayer connectionParameters, const unsigned char *packet, int packetSize)
+{
+    // Kept for the whole connection: the receiver sends it in every UA
+    openPacketSize = (packet && packetSize <= MAX_PIGGYBACK_SIZE) ? packetSize : 0;
+    if (openPacketSize > 0) memcpy(openPacket, packet, openPacketSize);
+    int result = llopen(connectionParameters);
+    if (result < 0)
+    {
+        openPacketSize = 0;
+        return -1;
+    }
+
+    // Not taken in the SET (a plain one, a peer without the capability, or
+    // too long for it): it goes as the first I frame
+    if (connection.role == LlTx && packet && !openPacketTaken)
+        return (llwrite(packet, packetSize) < 0) ? -1 : 0;
+    if (connection.role == LlTx && packet) printf("[llopen - TX] Packet of %d bytes taken in the SET\n", packetSize);
+    return 0;
+}
+
+int llopenAnswer(unsigned char *packet)
+{
+    memcpy(packet, answerPacket, answerPacketSize);
+    return answerPacketSize;
+}
+
+////////////////////////////////////////////////
+// LLWRITE  (Go-Back-N or Selective Repeat, stop-and-wait when windowSize is 1)
+////////////////////////////////////////////////
+
+
+// Encode the information field of an I frame into out: payload and check
+// (BCC2, or CRC-32C most significant byte first), byte stuffed or COBS.
+// With FEC, tag, payload, check and parity are first put together in field
+// (buf may already be at &field[1]).
+// Returns the encoded size or -1 if it needs more than outMax bytes.
+static int encodeInformation(const unsigned char *buf, int bufSize, unsigned char *field, unsigned char *out, int outMax)
+{
+    unsigned char trailer[4];
+    int trailerSize = 1;
+
+    if (frameCheck == LlCheckCrc32c)
+    {
+        uint32_t crc = crc32c(0, buf, bufSize);
+        trailer[0] = crc >> 24;
+        trailer[1] = crc >> 16;
+        trailer[2] = crc >> 8;
+        trailer[3] = crc;
+        trailerSize = 4;
+    }
+
+    if (fecEnabled)
+    {
+        // Tag, payload, check and parity make up the field to encode
+        int parity = fecParity(fecLevel);
+        if (1 + rsEncodedSize(bufSize + trailerSize, parity) > fieldCapacity) return -1;
+        if (frameCheck == LlCheckBcc2) trailer[0] = calcBCC2(buf, bufSize);
+
+        field[0] = fecTag(fecLevel);
+        if (buf != &field[1]) memcpy(&field[1], buf, bufSize);
+        memcpy(&field[1 + bufSize], trailer, trailerSize);
+        bufSize = 1 + rsEncode(&field[1], bufSize + trailerSize, parity);
+        buf = field;
+        trailerSize = 0;
+    }
+
+    if (framing == LlFramingCobs)
+    {
+        if (frameCheck == LlCheckBcc2 && !fecEnabled) trailer[0] = calcBCC2(buf, bufSize);
+
+        CobsEncoder encoder;
+        cobsBegin(&encoder, out, outMax);
+        if (cobsPut(&encoder, buf, bufSize) < 0 || cobsPut(&encoder, trailer, trailerSize) < 0) return -1;
+        return cobsEnd(&encoder);
+    }
+
+    // BCC2 comes out of the stuffing pass
+    unsigned char bcc2 = 0;
+    int size = bytestuffingBCC2(buf, bufSize, out, outMax - 2 * trailerSize, &bcc2);
+    if (size < 0) return -1;
+    if (frameCheck == LlCheckBcc2 && !fecEnabled) trailer[0] = bcc2;
+
+    return size + bytestuffing(trailer, trailerSize, &out[size], 2 * trailerSize);
+}
+
+// Encode I frame ns straight into its window slot, where it stays for
+// retransmissions. Returns its size or -1.
+static int encodeFrame(int ns, const unsigned char *buf, int bufSize)
+{
+    claimTxSlot(ns);
+    TxFrame *tx = &txWindow[ns];
+    int frameSize = buildHeader(tx->frame, A_TX, C_IX, ns);
+
+    int infoSize = encodeInformation(buf, bufSize, tx->field, &tx->frame[frameSize], frameCapacity - frameSize - 1);
+    if (infoSize < 0) return -1;
+    frameSize += infoSize;
+    tx->frame[frameSize++] = FLAG;
+    tx->size = frameSize;
+    tx->payloadSize = bufSize;
+    tx->fecLevel = fecLevel;
+    return frameSize;
+}
+
+// One-way link: a UI frame, written once and forgotten
+static int sendUIFrame(const unsigned char *buf, int bufSize)
+{
+    claimTxSlot(0);
+    TxFrame *tx = &txWindow[0];
+    int frameSize = buildHeader(tx->frame, A_TX, C_UI, 0);
+
+    int infoSize = encodeInformation(buf, bufSize, tx->field, &tx->frame[frameSize], frameCapacity - frameSize - 1);
+    if (infoSize < 0) return -1;
+    frameSize += infoSize;
+    tx->frame[frameSize++] = FLAG;
+
+    if (writeAll(tx->frame, frameSize) < 0)
+    {
+        perror("[llwrite] Write failed");
+        return -1;
+    }
+    queueOnLine(frameSize);
+    stats.framesSent++;
+    stats.framesEncoded++;
+    stats.encodedBytes += frameSize;
+    printf("[llwrite] Sent UI frame (%d bytes)\n", frameSize);
+    return bufSize;
+}
+
+int llmaxPayload()
+{
+    return maxPayload - (aggregationEnabled ? PACKET_HEADER_SIZE : 0);
+}
+
+int llpayloadSize()
+{
+    return payloadTarget - (aggregationEnabled ? PACKET_HEADER_SIZE : 0);
+}
+
+// With compression, put buf into packed behind its marker: compressed if
+// that makes it smaller, as it is otherwise. Returns the packed size.
+static int packPayload(const unsigned char *buf, int bufSize)
+{
+    int size = lzCompress(buf, bufSize, &packed[1], bufSize - 1);
+    if (size < 0)
+    {
+        packed[0] = PAYLOAD_STORED;
+        memcpy(&packed[1], buf, bufSize);
+        size = bufSize;
+    }
+    else
+        packed[0] = PAYLOAD_LZ;
+    stats.packedBytes += 1 + size;
+    return 1 + size;
+}
+
+// Send a payload in the next I frame (compressed first, if agreed on)
+static int sendPayload(const unsigned char *buf, int bufSize)
+{
+    int payloadSize = bufSize;
+    if (compressionEnabled)
+    {
+        bufSize = packPayload(buf, bufSize);
+        buf = packed;
+    }
 
-static LinkLayer connection;
-static int alarmEnabled = 0;
-static int alarmCount = 0;
-static int expectedNs = 0;
-static unsigned char sequenceNumber = 0; // Ns
+    if (connection.simplex) return sendUIFrame(buf, bufSize);
 
-#define _POSIX_SOURCE 1 // POSIX compliant source
+    // Wait for room in the window
+    if (waitForAcks(connection.windowSize - 1) < 0) return giveUp();
 
-////////////////////////////////////////////////
-// Timeout handler
-////////////////////////////////////////////////
-void alarmHandler(int signal)
+    TxFrame *tx = &txWindow[sequenceNumber];
+    int frameSize = encodeFrame(sequenceNumber, buf, bufSize);
+    if (frameSize < 0) return -1;
+    stats.framesEncoded++;
+    stats.encodedBytes += frameSize;
+
+    if (sendWindowFrame(sequenceNumber) < 0) return -1;
+    printf("[llwrite] Sent I frame Ns=%d (%d bytes)\n", sequenceNumber, frameSize);
+
+    tx->retransmitted = FALSE;
+    tx->retries = 0;
+    sequenceNumber = (sequenceNumber + 1) % modulus;
+    fecAdapt(FALSE);
+    sizeAdapt(frameSize, payloadSize);
+
+    // Pick up acknowledgements that are already waiting, without blocking
+    if (waitForAcks(connection.windowSize) < 0) return giveUp();
+    return 0;
+}
+
+// Aggregation: send the packets queued so far in one frame
+static int flushBatch()
+{
+    batchExpired = FALSE;
+    if (batchSize == 0) return 0;
+    stopTimer(batchTimerFd);
+    int size = batchSize;
+    batchSize = 0;
+    return sendPayload(batch, size);
+}
+
+int llwrite(const unsigned char *buf, int bufSize)
 {
-    alarmEnabled = 0;
-    alarmCount++;
+    if (bufSize < 1 || bufSize > llmaxPayload()) return -1;
+    stats.payloadBytes += bufSize;
+    stats.packetsSent++;
+    if (!aggregationEnabled) return (sendPayload(buf, bufSize) < 0) ? -1 : bufSize;
+
+    // Nagle: a packet joins those already queued while there is room and
+    // frames are unacknowledged; the frame goes out once nothing else fits,
+    // the line is idle or the batch timer, armed by the first packet, expires
+    // (waitForAcks() sends it then, whatever it is waiting for)
+    if (batchSize > 0 && batchSize + PACKET_HEADER_SIZE + bufSize > payloadTarget && flushBatch() < 0) return -1;
+
+    if (batchSize == 0 && armTimer(batchTimerFd, connection.aggregationDelayMs) < 0) return -1;
+    batch[batchSize++] = bufSize >> 8;
+    batch[batchSize++] = bufSize & 0xFF;
+    memcpy(&batch[batchSize], buf, bufSize);
+    batchSize += bufSize;
+
+    if (waitForAcks(connection.windowSize) < 0) return giveUp();
+    if (batchSize + PACKET_HEADER_SIZE >= payloadTarget || outstandingFrames() == 0)
+    {
+        if (flushBatch() < 0) return -1;
+    }
+    return bufSize;
 }
 
 ////////////////////////////////////////////////
-// Byte Stuffing
+// LLREAD (Receiver side, sends RR/REJ/SREJ)
 ////////////////////////////////////////////////
-int bytestuffing(const unsigned char *data, size_t length, unsigned char *out, int outMax)
+
+// Ask for the frame expected next. With a window, one REJ per gap is enough:
+// the sender goes back and resends everything after it.
+static void requestRetransmission()
+{
+    if (isExtended() && rejSent) return;
+    sendREJ(expectedNs);
+    rejSent = TRUE;
+}
+
+// Selective Repeat: keep a frame received after a gap and ask for each
+// missing frame before it (once; timeouts cover lost retransmissions)
+static void bufferFrame(int ns, const unsigned char *payload, int payloadSize)
 {
-    int outidx = 0;
-    for (size_t i = 0; i < length; i++)
+    RxFrame *rx = &rxWindow[ns];
+    if (!rx->present)
     {
-        unsigned char byte = data[i];
+        claimRxSlot(ns);
+        memcpy(rx->data, payload, payloadSize);
+        rx->size = payloadSize;
+        rx->present = TRUE;
+        rx->srejSent = FALSE;
+        stats.framesBuffered++;
+    }
 
-        if (outidx >= outMax - 1)
+    for (int k = expectedNs; k != ns; k = (k + 1) % modulus)
+    {
+        if (!rxWindow[k].present && !rxWindow[k].srejSent)
         {
-            fprintf(stderr, "[bytestuffing] out of space\n");
-            return -1;
+            sendSREJ(k);
+            rxWindow[k].srejSent = TRUE;
         }
+    }
+}
 
-        if (byte == FLAG)
-        {
-            out[outidx++] = ESC;
-            out[outidx++] = ESCAUX;
-        }
-        else if (byte == ESC)
-        {
-            out[outidx++] = ESC;
-            out[outidx++] = ESCAUX2;
-        }
-        else
-        {
-            out[outidx++] = byte;
-        }
+// Number of frames from expectedNs to ns, i.e. how far ahead of the gap ns is
+static int framesAhead(int ns)
+{
+    return (ns - expectedNs + modulus) % modulus;
+}
+
+// FEC statistics of a received I or UI frame
+static void countCorrections(const FrameEvent *event)
+{
+    if (event->corrected > 0 && event->valid)
+    {
+        stats.fecFrames++;
+        stats.fecBytes += event->corrected;
     }
-    return outidx;
+    else if (event->corrected < 0)
+        stats.fecFailures++;
 }
 
 ////////////////////////////////////////////////
-// Byte Destuffing
+// Chase combining (receiver)
 ////////////////////////////////////////////////
-int destuff(const unsigned char *data, size_t length, unsigned char *out, int outMax)
+static void forgetCopies(int ns)
+{
+    harqWindow[ns].count = 0;
+    harqWindow[ns].next = 0;
+}
+
+// Copies of ns are worth keeping if a good one would be accepted
+static int wantsCopies(int ns)
+{
+    if (!connection.chaseCombining || frameCheck != LlCheckCrc32c) return FALSE;
+    if (!isSelectiveRepeat()) return ns == expectedNs;
+    return framesAhead(ns) < connection.windowSize && !rxWindow[ns].present;
+}
+
+// Bitwise majority of the three copies, a word at a time
+static void majorityOfCopies(const HarqFrame *harq)
 {
-    int outidx = 0;
-    for (size_t i = 0; i < length; i++)
+    const unsigned char *a = harq->copies[0], *b = harq->copies[1], *c = harq->copies[2];
+    int i = 0;
+    for (; i + 8 <= harq->size; i += 8)
     {
-        if (outidx >= outMax)
-        {
-            fprintf(stderr, "[destuff] out of space\n");
-            return -1;
-        }
+        uint64_t x, y, z;
+        memcpy(&x, &a[i], 8);
+        memcpy(&y, &b[i], 8);
+        memcpy(&z, &c[i], 8);
+        uint64_t m = (x & y) | (x & z) | (y & z);
+        memcpy(&harqField[i], &m, 8);
+    }
+    for (; i < harq->size; i++)
+        harqField[i] = (a[i] & b[i]) | (a[i] & c[i]) | (b[i] & c[i]);
+}
+
+// Errors rarely hit the same byte twice: where two copies differ, one of
+// them is right. Try every mix of the two at those bytes. With FEC, whole
+// codewords are mixed instead: each one decodes from either copy or neither.
+static int mixCopies(FrameEvent *event, const unsigned char *a, const unsigned char *b, int size)
+{
+    int *positions = harqPositions;
+    unsigned char *unitOf = harqUnits; // which of units[] each position belongs to
+    int units[HARQ_MAX_GUESSES];
+    int differences = 0, unitCount = 0;
+    int codewords = (size + RS_CODEWORD - 2) / RS_CODEWORD; // after the tag
 
-        if (data[i] == ESC && i + 1 < length)
+    for (int i = 0; i < size; i++)
+    {
+        if (a[i] == b[i]) continue;
+
+        int unit = !fecEnabled ? i : (i == 0) ? -1 : (i - 1) % codewords;
+        int u = 0;
+        while (u < unitCount && units[u] != unit)
+            u++;
+        if (u == unitCount)
         {
-            if (data[i + 1] == ESCAUX)
-                out[outidx++] = FLAG;
-            else if (data[i + 1] == ESCAUX2)
-                out[outidx++] = ESC;
-            i++;
+            if (unitCount == HARQ_MAX_GUESSES) return FALSE;
+            units[unitCount++] = unit;
         }
-        else
+        positions[differences] = i;
+        unitOf[differences++] = u;
+    }
+
+    // All of a or all of b already failed
+    memcpy(harqField, a, size);
+    for (unsigned mask = 1; mask + 1 < (1u << unitCount); mask++)
+    {
+        for (int k = 0; k < differences; k++)
+            harqField[positions[k]] = ((mask >> unitOf[k]) & 1) ? b[positions[k]] : a[positions[k]];
+
+        parserRecheck(&parser, harqField, size, event);
+        if (event->valid) return TRUE;
+    }
+    return FALSE;
+}
+
+// Frame event->n failed its check: keep this copy and try to rebuild the
+// frame from the copies so far. Returns TRUE if *event now holds it.
+static int combineCopies(FrameEvent *event)
+{
+    HarqFrame *harq = &harqWindow[event->n];
+    int size = event->fieldSize;
+    if (size <= 0) return FALSE;
+    claimRxSlot(event->n);
+
+    // A copy that lost or gained bytes does not line up with the others
+    if (harq->count > 0 && harq->size != size) forgetCopies(event->n);
+
+    int newest = harq->next;
+    memcpy(harq->copies[newest], event->field, size);
+    harq->size = size;
+    harq->next = (newest + 1) % HARQ_COPIES;
+    if (harq->count < HARQ_COPIES) harq->count++;
+    stats.harqCopies++;
+
+    if (harq->count == HARQ_COPIES)
+    {
+        majorityOfCopies(harq);
+        parserRecheck(&parser, harqField, size, event);
+        if (event->valid)
         {
-            out[outidx++] = data[i];
+            stats.harqMajority++;
+            printf("[llread] Frame Ns=%d rebuilt from %d copies\n", event->n, HARQ_COPIES);
+            return TRUE;
         }
     }
-    return outidx;
+
+    int previous = (newest + HARQ_COPIES - 1) % HARQ_COPIES;
+    if (harq->count >= 2 && mixCopies(event, harq->copies[newest], harq->copies[previous], size))
+    {
+        stats.harqPairs++;
+        printf("[llread] Frame Ns=%d rebuilt from 2 copies\n", event->n);
+        return TRUE;
+    }
+    return FALSE;
 }
 
-////////////////////////////////////////////////
-// Helper: send supervision frame (SET, UA, DISC, RR, REJ)
-////////////////////////////////////////////////
-static void sendSupervisionFrame(unsigned char address, unsigned char control)
+// With compression, expand the payload of a frame that passed its check
+// into unpacked and point event at it. Returns -1 if it does not expand to
+// a payload (which a frame the check let through only gets from a broken
+// peer).
+static int unpackPayload(FrameEvent *event)
 {
-    unsigned char frame[5];
-    frame[0] = FLAG;
-    frame[1] = address;
-    frame[2] = control;
-    frame[3] = calcBCC1(address, control);
-    frame[4] = FLAG;
+    if (!compressionEnabled) return 0;
+    if (event->dataSize < 1) return -1;
+
+    int size = event->dataSize - 1;
+    if (event->data[0] == PAYLOAD_STORED && size <= maxPayload)
+        memcpy(unpacked, &event->data[1], size);
+    else if (event->data[0] == PAYLOAD_LZ)
+        size = lzDecompress(&event->data[1], size, unpacked, maxPayload);
+    else
+        size = -1;
+    if (size < 1) return -1;
 
-    writeBytesSerialPort(frame, 5);
+    event->data = unpacked;
+    event->dataSize = size;
+    return 0;
 }
 
-////////////////////////////////////////////////
-// Simple helpers to send RR and REJ frames
-////////////////////////////////////////////////
-static void sendRR(int expectedNs)
+// Receiver: put a payload at the tail of the delivery queue, either copied
+// or (from the Selective Repeat window) swapped in with the slot's buffer
+static void enqueuePayload(RxFrame *rx, const unsigned char *payload, int payloadSize)
 {
-    unsigned char control = (expectedNs == 0) ? C_RR0 : C_RR1;
-    sendSupervisionFrame(A_RX, control);
-    printf("[llread] Sent RR(%d)\n", expectedNs);
+    RxFrame *tail = &rxQueue[(rxQueueHead + rxQueueCount) % rxQueueSlots];
+    if (rx)
+    {
+        unsigned char *data = tail->data;
+        tail->data = rx->data;
+        rx->data = data;
+        rx->present = FALSE;
+    }
+    else
+    {
+        memcpy(tail->data, payload, payloadSize);
+    }
+    tail->size = payloadSize;
+
+    rxQueueCount++;
+    if (rxQueueCount > stats.queuePeak) stats.queuePeak = rxQueueCount;
 }
 
-static void sendREJ(int expectedNs)
+// Receiver: queue a packet that came in a SET or DISC as a payload (behind
+// its size with aggregation)
+static void enqueuePacket(const unsigned char *packet, int packetSize)
 {
-    unsigned char control = (expectedNs == 0) ? C_REJ0 : C_REJ1;
-    sendSupervisionFrame(A_RX, control);
-    printf("[llread] Sent REJ(%d)\n", expectedNs);
+    RxFrame *tail = &rxQueue[(rxQueueHead + rxQueueCount) % rxQueueSlots];
+    int headerSize = aggregationEnabled ? PACKET_HEADER_SIZE : 0;
+
+    tail->data[0] = packetSize >> 8;
+    tail->data[1] = packetSize & 0xFF;
+    memcpy(&tail->data[headerSize], packet, packetSize);
+    tail->size = headerSize + packetSize;
+
+    rxQueueCount++;
+    if (rxQueueCount > stats.queuePeak) stats.queuePeak = rxQueueCount;
 }
 
-////////////////////////////////////////////////
-// Read a supervision frame (UA, RR, REJ, etc.)
-////////////////////////////////////////////////
-static int readSupervisionFrame(unsigned char *address, unsigned char *control)
+// Receiver: process an I frame, rebuilding it from earlier copies if it
+// failed its check.
+// Returns the size of its payload if it is the one expected next, 0 otherwise.
+static int handleIFrame(FrameEvent *event)
 {
-    unsigned char byte;
-    unsigned char buffer[5];
-    int state = 0;
-    int idx = 0;
+    int ns = event->n;
 
-    while (1)
+    countCorrections(event);
+    if (!event->valid && wantsCopies(ns)) combineCopies(event);
+    if (event->valid) forgetCopies(ns);
+    if (event->valid && unpackPayload(event) < 0) event->valid = FALSE;
+
+    // Gaps and duplicates are answered at once, after what was pending
+    if (!event->valid || ns != expectedNs) flushAck();
+
+    if (!event->valid)
     {
-        if (readByteSerialPort(&byte) == 1)
+        if (isSelectiveRepeat())
         {
-            switch (state)
+            int ahead = framesAhead(ns);
+            if (ahead < connection.windowSize && !rxWindow[ns].present)
             {
-            case 0:
-                if (byte == FLAG) state = 1;
-                break;
-
-            case 1:
-                if (byte == FLAG) break;
-                buffer[idx++] = byte; // A
-                if (byte != A_TX && byte != A_RX) { state = 0; idx = 0; break; }
-                state = 2;
-                break;
-
-            case 2:
-                if (byte == FLAG) { state = 1; idx = 0; break; }
-                buffer[idx++] = byte; // C
-                state = 3;
-                break;
-
-            case 3:
-                if (byte == FLAG) { state = 1; idx = 0; break; }
-                buffer[idx++] = byte; // BCC
-                state = 4;
-                break;
-
-            case 4:
-                if (byte == FLAG)
-                {
-                    unsigned char A = buffer[0];
-                    unsigned char C = buffer[1];
-                    unsigned char BCC = buffer[2];
-                    if (isValidBCC1(A, C, BCC))
-                    {
-                        *address = A;
-                        *control = C;
-                        return 0;
-                    }
-                    else { state = 0; idx = 0; }
-                }
-                else { state = 0; idx = 0; }
-                break;
+                printf("[llread] Invalid BCC2 -> SREJ(%d)\n", ns);
+                sendSREJ(ns);
+                rxWindow[ns].srejSent = TRUE;
             }
+            return 0;
         }
+        printf("[llread] Invalid BCC2 -> REJ(%d)\n", expectedNs);
+        requestRetransmission();
+        return 0;
     }
-}
+    printf("[llread] Received frame Ns=%d, expected Ns=%d\n", ns, expectedNs);
 
-////////////////////////////////////////////////
-// LLOPEN
-////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters)
-{
-    alarmEnabled = 0;
-    alarmCount = 0;
-    connection = connectionParameters;
+    if (ns == expectedNs)
+    {
+        // Frames buffered behind the gap are now in sequence too, and all
+        // of them need room in the queue, or this one is taken as lost
+        int released = 0;
+        while (isSelectiveRepeat() && rxWindow[(ns + 1 + released) % modulus].present)
+            released++;
+        if (rxQueueSlots - rxQueueCount < 1 + released)
+        {
+            printf("[llread] Delivery queue full, frame Ns=%d dropped\n", ns);
+            stats.framesRefused++;
+            if (rnrEnabled) sendAck(expectedNs);
+            return 0;
+        }
+
+        rxWindow[ns].srejSent = FALSE;
+        sessionStarted = TRUE;
+        enqueuePayload(NULL, event->data, event->dataSize);
+        expectedNs = (expectedNs + 1) % modulus;
+        stats.framesReceived += 1 + released;
+        for (; released > 0; released--)
+        {
+            enqueuePayload(&rxWindow[expectedNs], NULL, rxWindow[expectedNs].size);
+            expectedNs = (expectedNs + 1) % modulus;
+        }
+
+        // (acknowledged at once if a gap was filled: the transmitter is
+        // waiting on it)
+        acknowledgeInSequence(rejSent || expectedNs != (ns + 1) % modulus);
+        rejSent = FALSE;
+        return event->dataSize;
+    }
 
-    if (openSerialPort(connection.serialPort, connection.baudRate) < 0)
+    int ahead = framesAhead(ns);
+    if (isSelectiveRepeat() && ahead < connection.windowSize)
     {
-        perror("Error opening serial port");
-        return -1;
+        printf("[llread] Out-of-order frame Ns=%d -> buffered\n", ns);
+        bufferFrame(ns, event->data, event->dataSize);
+    }
+    else if (isExtended() && ahead < connection.windowSize)
+    {
+        printf("[llread] Out-of-order frame Ns=%d -> REJ(%d)\n", ns, expectedNs);
+        requestRetransmission();
+    }
+    else
+    {
+        printf("[llread] Duplicate frame, acknowledge again\n");
+        sendAck(expectedNs);
     }
+    return 0;
+}
 
-    struct sigaction sa;
-    sa.sa_handler = alarmHandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGALRM, &sa, NULL);
+// One-way receiver: a UI frame that passed its check is handed over, one
+// that did not is dropped (what runs above the link makes up for it).
+// Returns the size of its payload, 0 if dropped.
+static int handleUIFrame(FrameEvent *event)
+{
+    countCorrections(event);
+    if (!event->valid || unpackPayload(event) < 0 || rxQueueCount == rxQueueSlots)
+    {
+        stats.framesDropped++;
+        return 0;
+    }
 
-    unsigned char address, control;
+    enqueuePayload(NULL, event->data, event->dataSize);
+    stats.framesReceived++;
+    return event->dataSize;
+}
 
-    if (connection.role == LlTx)
+////////////////////////////////////////////////
+// Frame dispatch. Every frame goes through here whatever the caller is
+// waiting for, so an RR read by llread(), an I frame retransmitted into
+// llclose() or a SET repeated after a lost UA still gets its answer.
+// Callers then look at the event for what they are waiting on (UA, DISC).
+// Returns -1 if the transmitter has to give up, otherwise the size of the
+// payload of an I frame that arrived in sequence (0 if none).
+////////////////////////////////////////////////
+static int dispatchFrame(FrameEvent *event)
+{
+    if (!event->headerValid)
     {
-        // Transmitter
-        while (alarmCount < connection.nRetransmissions)
+        // Selective Repeat cannot name a frame whose header is corrupted
+        if (connection.role == LlRx && !isSelectiveRepeat() &&
+            event->address == A_TX && event->type == FRAME_I)
         {
-            sendSupervisionFrame(A_TX, C_SET);
-            printf("[llopen - TX] SET frame sent\n");
-
-            alarmEnabled = 1;
-            alarm(connection.timeout);
+            printf("[llread] Invalid BCC1 -> REJ(%d)\n", expectedNs);
+            requestRetransmission();
+        }
+        return 0;
+    }
 
-            while (alarmEnabled)
-            {
-                if (readSupervisionFrame(&address, &control) == 0 &&
-                    address == A_RX && control == C_UA)
-                {
-                    alarm(0);
-                    sequenceNumber = 0; 
-                    printf("[llopen - TX] UA received\n");
-                    return 0;
-                }
-            }
+    if (connection.role == LlTx)
+    {
+        if (event->address != A_RX || !event->valid) return 0;
 
-            printf("[llopen - TX] Timeout %d/%d\n", alarmCount, connection.nRetransmissions);
+        switch (event->type)
+        {
+        case FRAME_RR:
+        case FRAME_RNR:
+        case FRAME_REJ:
+        case FRAME_SREJ:
+            return handleAck(event);
+        case FRAME_DISC:
+            discReceived = TRUE;
+            return 0;
+        case FRAME_UA:
+            return 0;
+        default:
+            printf("[llwrite] Unexpected frame: A=0x%02X C=0x%02X\n", event->address, event->control);
+            return 0;
         }
+    }
 
-        printf("[llopen - TX] Connection failed\n");
-        return -1;
+    if (event->address != A_TX) return 0;
+
+    // A one-way receiver never answers
+    if (connection.simplex)
+    {
+        if (event->type == FRAME_UI) return handleUIFrame(event);
+        if (event->type == FRAME_DISC && event->valid) discReceived = TRUE;
+        return 0;
     }
-    else
+
+    switch (event->type)
     {
-        // Receiver
-        printf("[llopen - RX] Waiting for SET...\n");
-        while (1)
+    case FRAME_I:
+        return handleIFrame(event);
+    case FRAME_SET:
+        // Answered every time: a repeated SET means our UA was lost
+        if (event->valid) answerSET(event);
+        return 0;
+    case FRAME_RR:
+        // A transmitter told to wait polls with RR until it is told it can
+        // go on
+        if (event->valid) sendAck(expectedNs);
+        return 0;
+    case FRAME_DISC:
+        if (!event->valid) return 0;
+        if (!discReceived && piggybackEnabled)
         {
-            if (readSupervisionFrame(&address, &control) == 0 &&
-                address == A_TX && control == C_SET)
+            // The last packet, queued once; without room the DISC is taken
+            // as lost (and comes again)
+            const unsigned char *packet;
+            int packetSize = findPacket(event, &packet);
+            if (packetSize > 0 && rxQueueCount == rxQueueSlots)
             {
-                printf("[llopen - RX] SET received\n");
-                sendSupervisionFrame(A_RX, C_UA);
-                printf("[llopen - RX] UA sent\n");
-                expectedNs = 0;
+                if (rnrEnabled) sendNumberedSupervisionFrame(A_RX, C_RNRX, expectedNs);
                 return 0;
             }
+            if (packetSize > 0)
+            {
+                enqueuePacket(packet, packetSize);
+                printf("[llread] Packet of %d bytes taken from the DISC\n", packetSize);
+            }
         }
+        discReceived = TRUE;
+
+        // The application has not read everything yet
+        if (rnrEnabled && rxQueueCount > 0) sendNumberedSupervisionFrame(A_RX, C_RNRX, expectedNs);
+        return 0;
+    default:
+        return 0;
     }
 }
 
-////////////////////////////////////////////////
-// LLWRITE  (Stop-and-Wait implemented)
-////////////////////////////////////////////////
-
-
-int llwrite(const unsigned char *buf, int bufSize)
+// Receive the next payload in sequence. *payload is set to its slot in the
+// delivery queue, which is kept until the next call.
+static int receiveFramePayload(const unsigned char **payload)
 {
-    unsigned char frame[MAX_FRAME_SIZE];
-    int frameSize = 0;
-
-    unsigned char A = A_TX;
-    unsigned char C = (sequenceNumber == 0) ? C_I0 : C_I1;
-
-    frame[frameSize++] = FLAG;
-    frame[frameSize++] = A;
-    frame[frameSize++] = C;
-    frame[frameSize++] = calcBCC1(A, C);
+    FrameEvent event;
 
-    // Append BCC2 before stuffing
-    unsigned char temp[MAX_PAYLOAD_SIZE];
-    memcpy(temp, buf, bufSize);
-    temp[bufSize] = calcBCC2(buf, bufSize);
+    // The slot handed out last time is free again, which may be all a
+    // transmitter told to wait is waiting for
+    if (rxQueueTaken)
+    {
+        rxQueueHead = (rxQueueHead + 1) % rxQueueSlots;
+        rxQueueCount--;
+        rxQueueTaken = FALSE;
+        if (rnrSent && !receiverBusy()) sendAck(expectedNs);
+    }
 
-    unsigned char stuffed[STUFFED_BUFFER_SIZE];
-    int stuffedSize = bytestuffing(temp, bufSize + 1, stuffed, STUFFED_BUFFER_SIZE);
-    if (stuffedSize < 0) return -1;
+    // With RNR, frames already on the line are taken in first: how many pile
+    // up in the queue is how far behind the application is. Without it they
+    // are left there, as the transmitter would only overrun the queue.
+    while (rnrEnabled && nextFrame(&event, FALSE) > 0)
+        dispatchFrame(&event);
 
-    memcpy(&frame[frameSize], stuffed, stuffedSize);
-    frameSize += stuffedSize;
-    frame[frameSize++] = FLAG;
+    while (rxQueueCount == 0)
+    {
+        if (discReceived)
+        {
+            printf("[llread] DISC frame received while waiting for data\n");
+            return -2;
+        }
+        if (nextFrame(&event, TRUE) > 0) dispatchFrame(&event);
+    }
 
-    // Stop-and-Wait: send and wait for RR/REJ
-    alarmCount = 0;
+    *payload = rxQueue[rxQueueHead].data;
+    rxQueueTaken = TRUE;
+    sessionStarted = TRUE;
+    return rxQueue[rxQueueHead].size;
+}
 
-    while (alarmCount < connection.nRetransmissions)
+// Receive the next packet: the next payload, or with aggregation the next
+// packet in it (in the same place as the payload)
+static int receivePayload(const unsigned char **payload)
+{
+    while (1)
     {
-        if (writeBytesSerialPort(frame, frameSize) < 0) {
-            perror("[llwrite] Write failed");
-            return -1;
-        }
-        printf("[llwrite] Sent I frame Ns=%d (%d bytes)\n", sequenceNumber, frameSize);
-        
-        alarmEnabled = 1;
-        alarm(connection.timeout);
-        
-        unsigned char addr, ctrl;
-        
-        while (alarmEnabled)
+        // (checked once the payload is in: a SET for a new session may have
+        // turned aggregation on or off meanwhile)
+        while (rxBatchLeft == 0)
         {
-            if (readSupervisionFrame(&addr, &ctrl) == 0)
+            int size = receiveFramePayload(&rxBatch);
+            if (size <= 0 || !aggregationEnabled)
             {
-                printf("readSupervisionFrame(&addr, &ctrl) == 0\n"); 
-                int expected_rr = (sequenceNumber == 0) ? C_RR1 : C_RR0;
-                int expected_rej = (sequenceNumber == 0) ? C_REJ0 : C_REJ1;
-                
-                if (ctrl == expected_rr)
-                {
-                    alarm(0);
-                    printf("[llwrite] RR received -> frame accepted\n");
-                    sequenceNumber ^= 1; // toggle Ns
-                    return bufSize;
-                }
-                else if (ctrl == expected_rej)
-                {
-                    alarm(0);
-                    printf("[llwrite] REJ received -> retransmit\n");
-                    break; // retry loop
-                }
-                else printf("[llwrite] Unexpected frame: A=0x%02X C=0x%02X\n", addr, ctrl);
-                
+                *payload = rxBatch;
+                return size;
             }
+            rxBatchLeft = size;
         }
-        
-        alarmCount++;
-        printf("[llwrite] Timeout/retry %d/%d\n", alarmCount, connection.nRetransmissions);
-    }
 
+        int size = (rxBatchLeft >= PACKET_HEADER_SIZE) ? (rxBatch[0] << 8 | rxBatch[1]) : -1;
+        if (size < 1 || size > rxBatchLeft - PACKET_HEADER_SIZE)
+        {
+            // Only a broken peer gets this past the frame check
+            printf("[llread] Malformed aggregated payload, %d bytes dropped\n", rxBatchLeft);
+            rxBatchLeft = 0;
+            continue;
+        }
 
-    printf("[llwrite] Transmission failed after retries\n"); //perguntar ao stor sobre isto nao deve estar correto mas funciona
+        *payload = &rxBatch[PACKET_HEADER_SIZE];
+        rxBatch += PACKET_HEADER_SIZE + size;
+        rxBatchLeft -= PACKET_HEADER_SIZE + size;
+        stats.packetsReceived++;
+        return size;
+    }
+}
 
-    unsigned char give_up_frame[5];
-    give_up_frame[0] = FLAG;
-    give_up_frame[1] = A_TX;
-    give_up_frame[2] = C_DISC; 
-    give_up_frame[3] = calcBCC1(A_TX, C_DISC);
-    give_up_frame[4] = FLAG;
-    
-    writeBytesSerialPort(give_up_frame, 5);
+int llread(unsigned char *packet)
+{
+    const unsigned char *payload;
+    int size = receivePayload(&payload);
 
+    if (size > 0) memcpy(packet, payload, size);
+    return size;
+}
 
-    return -1;
+int llreadView(const unsigned char **packet)
+{
+    return receivePayload(packet);
 }
 
 ////////////////////////////////////////////////
-// LLREAD (Receiver side, sends RR/REJ)
+// LLCLOSE
 ////////////////////////////////////////////////
+static void printStatistics()
+{
+    const char *kind = connection.simplex ? "UI" : "I";
 
+    printf("\n=== Link statistics ===\n");
+    if (connection.role == LlTx)
+    {
+        printf("  - %s frames sent: %d\n", kind, stats.framesSent);
+        printf("  - Retransmissions: %d\n", stats.retransmissions);
+        if (stats.framesEncoded > 0)
+            printf("  - Encoded %d %s frames (%.3f bytes written per payload byte), %.2f transmissions each\n",
+                   stats.framesEncoded, kind, (double)stats.encodedBytes / stats.payloadBytes,
+                   (double)stats.framesSent / stats.framesEncoded);
+        if (aggregationEnabled)
+            printf("  - Aggregation: %d packets in %d frames\n", stats.packetsSent, stats.framesEncoded);
+        if (stats.packedBytes > 0)
+            printf("  - Compression: %ld payload bytes packed into %ld (%.3f)\n", stats.payloadBytes,
+                   stats.packedBytes, (double)stats.packedBytes / stats.payloadBytes);
+        printf("  - Timeouts: %d\n", stats.timeouts);
+        if (fecEnabled)
+            printf("  - FEC: parity %d bytes per codeword at the end, raised %d and lowered %d times, %d frames re-encoded\n",
+                   fecParity(fecLevel), stats.fecRaised, stats.fecLowered, stats.fecReencoded);
+        if (connection.adaptiveFrameSize && !connection.simplex)
+            printf("  - Payload size: %d bytes at the end (%d to %d), raised %d and lowered %d times\n", payloadTarget,
+                   stats.sizeSmallest, stats.sizeLargest, stats.sizeGrown, stats.sizeShrunk);
+        if (stats.rnrReceived > 0)
+            printf("  - Receiver busy: told to wait %d times, %.0f ms paused, %d polls\n", stats.rnrReceived,
+                   stats.pausedMs, stats.polls);
+        if (stats.outages > 0)
+            printf("  - Line down %d times, %.1f s in all until it came back, %d probes\n", stats.outages,
+                   stats.outageMs / 1000, stats.resyncProbes);
+    }
+    else
+    {
+        printf("  - %s frames accepted: %d\n", kind, stats.framesReceived);
+        if (aggregationEnabled)
+            printf("  - Aggregation: %d packets in them\n", stats.packetsReceived);
+        if (connection.simplex)
+            printf("  - UI frames dropped (failed their check): %d\n", stats.framesDropped);
+        else
+        {
+            if (stats.framesReceived > 0)
+                printf("  - RR sent: %d (%.2f per frame delivered, one every %d frames or %d ms)\n", stats.rrSent,
+                       (double)stats.rrSent / stats.framesReceived, ackEvery(), connection.ackDelayMs);
+            printf("  - REJ sent: %d\n", stats.rejSent);
+            printf("  - SREJ sent: %d\n", stats.srejSent);
+            printf("  - Frames buffered out of order: %d\n", stats.framesBuffered);
+            if (rnrEnabled)
+                printf("  - Delivery queue: at most %d of %d slots used, RNR sent %d times, %d frames refused\n",
+                       stats.queuePeak, rxQueueSlots, stats.rnrSent, stats.framesRefused);
+        }
+        if (fecEnabled)
+            printf("  - FEC: %ld bytes repaired in %d frames, %d frames beyond repair\n",
+                   stats.fecBytes, stats.fecFrames, stats.fecFailures);
+        if (stats.harqCopies > 0)
+            printf("  - Chase combining: %d failed copies kept, %d frames rebuilt (%d by majority, %d from 2 copies)\n",
+                   stats.harqCopies, stats.harqMajority + stats.harqPairs, stats.harqMajority, stats.harqPairs);
+    }
+    if (connection.role == LlTx && !connection.simplex)
+        printf("  - SRTT: %.1f ms, RTTVAR: %.1f ms, RTO: %.1f ms\n", srtt, rttvar, rto);
+
+    SerialPortStats port;
+    getSerialPortStats(&port);
+    if (port.bytesRead > 0)
+        printf("  - read() calls: %ld (%.1f per KB received), epoll_wait() calls: %d\n",
+               port.readCalls, port.readCalls * 1024.0 / port.bytesRead, stats.epollWaits);
+    printf("  - write() calls: %ld for %ld bytes\n", port.writeCalls, port.bytesWritten);
+    printf("  - Window size: %d, max payload: %d, frame check: %s, framing: %s, FEC: %s, compression: %s, "
+           "aggregation: %s\n\n",
+           connection.windowSize, maxPayload, frameCheck == LlCheckCrc32c ? "CRC-32C" : "BCC2",
+           framing == LlFramingCobs ? "COBS" : "byte stuffing", fecEnabled ? "Reed-Solomon" : "off",
+           compressionEnabled ? "LZ" : "off", aggregationEnabled ? "on" : "off");
+}
 
-int llread(unsigned char *packet)
+// DISC, with the transmitter's last packet in it (llcloseWith())
+static void sendDISC(unsigned char address)
 {
-    unsigned char byte;
-    unsigned char buffer[MAX_FRAME_SIZE];
-    int state = 0;
-    int idx = 0;
+    unsigned char info[2 + MAX_PIGGYBACK_SIZE];
+    int size = (address == A_TX) ? putPacket(info, closePacket, closePacketSize) : 0;
+
+    if (size > 0)
+        sendUnnumberedFrame(address, C_DISC, info, size);
+    else
+        sendSupervisionFrame(address, C_DISC);
+}
 
+// Send DISC (address) until the frame awaited from peerAddress arrives, at
+// most nRetransmissions times (not counting those answered with RNR by a
+// receiver whose application is still reading). Everything else read
+// meanwhile is dispatched.
+// Returns 0 once it has arrived, -1 otherwise.
+static int sendDiscUntil(unsigned char address, FrameType awaited, unsigned char peerAddress)
+{
+    FrameEvent event;
+    const char *side = (connection.role == LlTx) ? "TX" : "RX";
 
-    while (1)
+    for (int attempt = 1; attempt <= connection.nRetransmissions; attempt++)
     {
-        if (readByteSerialPort(&byte) == 1)
-        {
-            switch (state)
-            {
-            case 0:
-                if (byte == FLAG) { state = 1; idx = 0; }
-                break;
-
-            case 1:
-                if (byte == FLAG) break;
-                if (byte != A_TX) { state = 0; idx = 0; break; }
-                buffer[idx++] = byte;
-                state = 2;
-                break;
-
-            case 2:
-                if (byte == FLAG) { state = 1; idx = 0; break; }
-
-                if (byte == C_DISC) {
-                    printf("[llread] DISC frame received while waiting for data\n");
-                    return -2; 
-                }
+        sendDISC(address);
+        printf("[llclose - %s] DISC sent\n", side);
 
-                if (byte != C_I0 && byte != C_I1) { state = 0; idx = 0; break; }
-                buffer[idx++] = byte;
-                state = 3;
-                break;
+        controlExpired = FALSE;
+        if (armTimer(controlTimerFd, rto) < 0) return -1;
+        int busy = FALSE;
 
-            case 3:
-                if (byte == FLAG) { state = 1; idx = 0; break; }
-                buffer[idx++] = byte;
-                state = 4;
-                break;
+        while (!controlExpired)
+        {
+            if (nextFrame(&event, TRUE) <= 0) continue;
+            dispatchFrame(&event);
+            if (isFrame(&event, FRAME_RNR, peerAddress)) busy = TRUE;
 
-            case 4:
-                if (byte == FLAG)
-                {
-                    unsigned char A = buffer[0];
-                    unsigned char C = buffer[1];
-                    unsigned char BCC1 = buffer[2];
-                    unsigned char *stuffedData = &buffer[3];
-                    int stuffedPayloadSize = idx - 3;
-
-                    if (!isValidBCC1(A, C, BCC1))
-                    {
-                        printf("[llread] Invalid BCC1 -> REJ(%d)\n", expectedNs);
-                        sendREJ(expectedNs);
-                        state = 0; idx = 0;
-                        break;
-                    }
-
-                    unsigned char receivedNs = (C == C_I1) ? 1 : 0;
-
-                    unsigned char destuffed[STUFFED_BUFFER_SIZE];
-                    int destuffedSize = destuff(stuffedData, stuffedPayloadSize, destuffed, STUFFED_BUFFER_SIZE);
-                    if (destuffedSize < 0)
-                    {
-                        printf("[llread] Destuff failed -> REJ(%d)\n", expectedNs);
-                        sendREJ(expectedNs);
-                        state = 0; idx = 0;
-                        break;
-                    }
-
-                    int payloadSize = destuffedSize - 1;
-                    unsigned char received_bcc2 = destuffed[destuffedSize - 1];
-                    
-                    unsigned char calc_bcc2 = calcBCC2(destuffed, payloadSize);
-
-                    if (calc_bcc2 != received_bcc2)
-                    {
-                        printf("[llread] Invalid BCC2 -> REJ(%d)\n", expectedNs);
-                        sendREJ(expectedNs);
-                        state = 0; idx = 0;
-                        break;
-                    }
-                    printf("[llread] Received frame Ns=%d, expected Ns=%d\n", receivedNs, expectedNs);
-
-                    if (receivedNs == expectedNs)
-                    {
-                        memcpy(packet, destuffed, payloadSize);
-                        printf("[llread] Frame OK (Ns=%d), sending RR(%d)\n", receivedNs, (expectedNs ^ 1));
-                        expectedNs ^= 1;
-                        sendRR(expectedNs);
-                        printf("[llread] RR(%d) sent successfully\n", expectedNs);
-                        return payloadSize;
-                    }
-                    else
-                    {
-                        printf("[llread] Duplicate frame, resend RR(%d)\n", expectedNs);
-                        sendRR(expectedNs);
-                        state = 0; idx = 0;
-                    }
-                }
-                else
-                {
-                    if (idx >= MAX_FRAME_SIZE)
-                    {
-                        printf("[llread] Frame too long\n");
-                        state = 0; idx = 0;
-                        break;
-                    }
-                    buffer[idx++] = byte;
-                }
-                break;
+            if (isFrame(&event, awaited, peerAddress))
+            {
+                stopTimer(controlTimerFd);
+                return 0;
+            }
+
+            // The receiver gets DISC again when its own DISC was lost
+            if (awaited != FRAME_DISC && isFrame(&event, FRAME_DISC, peerAddress))
+            {
+                sendDISC(address);
+                printf("[llclose - %s] DISC repeated, DISC sent\n", side);
             }
         }
+
+        backoffRto();
+        if (busy)
+        {
+            printf("[llclose - %s] Receiver busy\n", side);
+            attempt--;
+            continue;
+        }
+        printf("[llclose - %s] Timeout %d/%d\n", side, attempt, connection.nRetransmissions);
     }
+    return -1;
 }
 
-////////////////////////////////////////////////
-// LLCLOSE
-////////////////////////////////////////////////
-int llclose()
+// One-way link: nobody answers. The transmitter sends DISC a few times and
+// waits until everything written has left the port before closing it.
+static void closeSimplex()
 {
-    unsigned char address, control;
+    if (connection.role != LlTx) return;
 
-    if (connection.role == LlTx)
+    for (int i = 0; i < connection.nRetransmissions; i++)
     {
         sendSupervisionFrame(A_TX, C_DISC);
-        printf("[llclose - TX] DISC sent\n");
+        queueOnLine(5);
+    }
+    printf("[llclose - TX] DISC sent %d times\n", connection.nRetransmissions);
 
-        while (1)
+    long ns = (long)(queueOnLine(0) * 1e6);
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    nanosleep(&ts, NULL);
+}
+
+int llclose()
+{
+    FrameEvent event;
+    int result = 0;
+
+    if (connection.simplex)
+        closeSimplex();
+    else if (connection.role == LlTx)
+    {
+        // Packets still held back go first, then every frame in the window
+        // must be acknowledged before disconnecting
+        if (flushBatch() < 0 || waitForAcks(0) < 0)
         {
-            if (readSupervisionFrame(&address, &control) == 0 &&
-                address == A_RX && control == C_DISC)
-            {
-                printf("[llclose - TX] DISC received\n");
-                break;
-            }
+            giveUp();
+            printStatistics();
+            closeEngine();
+            closeSerialPort();
+            freeBuffers();
+            return -1;
         }
 
-        sendSupervisionFrame(A_TX, C_UA);
-        printf("[llclose - TX] UA sent\n");
+        if (sendDiscUntil(A_TX, FRAME_DISC, A_RX) == 0)
+        {
+            printf("[llclose - TX] DISC received\n");
+            sendSupervisionFrame(A_TX, C_UA);
+            printf("[llclose - TX] UA sent\n");
+        }
+        else
+        {
+            printf("[llclose - TX] No DISC from the receiver\n");
+            result = -1;
+        }
     }
     else
     {
+        // llread() may have seen the DISC already. Until it comes, late
+        // retransmissions of I frames still get their RR.
         printf("[llclose - RX] Waiting for DISC\n");
-        while (1)
+        while (!discReceived)
         {
-            if (readSupervisionFrame(&address, &control) == 0 &&
-                address == A_TX && control == C_DISC)
-            {
-                printf("[llclose - RX] DISC received\n");
-                sendSupervisionFrame(A_RX, C_DISC);
-                break;
-            }
+            // What the application did not read is dropped, and so is all a
+            // transmitter sends after the application gave up on the transfer
+            rxQueueCount = 0;
+            rxQueueTaken = FALSE;
+            if (rnrSent) sendAck(expectedNs);
+
+            if (nextFrame(&event, TRUE) > 0) dispatchFrame(&event);
         }
+        printf("[llclose - RX] DISC received\n");
 
-        while (1)
+        if (sendDiscUntil(A_RX, FRAME_UA, A_TX) == 0)
+            printf("[llclose - RX] UA received\n");
+        else
+            printf("[llclose - RX] No UA from the transmitter, closing anyway\n");
+    }
+
+    printStatistics();
+    closeEngine();
+    closeSerialPort();
+    freeBuffers();
+    openPacketSize = 0;
+    return result;
+}
+
+int llcloseWith(const unsigned char *packet, int packetSize)
+{
+    // Where the receiver does not take it in the DISC, it goes first
+    if (connection.role == LlTx && packet && !(piggybackEnabled && packetSize <= MAX_PIGGYBACK_SIZE))
+    {
+        if (llwrite(packet, packetSize) < 0)
         {
-            if (readSupervisionFrame(&address, &control) == 0 &&
-                address == A_TX && control == C_UA)
-            {
-                printf("[llclose - RX] UA received\n");
-                break;
-            }
+            llclose();
+            return -1;
         }
+        packet = NULL;
     }
 
-    closeSerialPort();
-    return 0;
+    closePacket = packet;
+    closePacketSize = packetSize;
+    int result = llclose();
+    closePacket = NULL;
+    return result;
 }
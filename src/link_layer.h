@@ -10,6 +10,39 @@ typedef enum
     LlRx,
 } LinkLayerRole;
 
+typedef enum
+{
+    LlGoBackN,
+    LlSelectiveRepeat,
+} LinkLayerArq;
+
+typedef enum
+{
+    LlCheckBcc2,   // 1-byte XOR
+    LlCheckCrc32c, // CRC-32C
+} LinkLayerCheck;
+
+typedef enum
+{
+    LlFramingStuffing, // FLAG/ESC byte stuffing: up to 2x for FLAG-heavy data
+    LlFramingCobs,     // COBS: at most 1 byte per 254
+} LinkLayerFraming;
+
+typedef enum
+{
+    LlFecOff,      // no forward error correction
+    LlFecRs247,    // Reed-Solomon, 8 parity bytes per 255: corrects 4
+    LlFecRs239,    // 16 parity bytes: corrects 8
+    LlFecRs223,    // 32 parity bytes: corrects 16
+    LlFecAdaptive, // from none to RS(255,223), following the retransmission rate
+} LinkLayerFec;
+
+typedef enum
+{
+    LlCompressionOff,
+    LlCompressionLz, // LZ77 per frame; frames it does not shrink go out as they are
+} LinkLayerCompression;
+
 typedef struct
 {
     char serialPort[50];
@@ -17,12 +50,71 @@ typedef struct
     int baudRate;
     int nRetransmissions;
     int timeout;
+    int windowSize; // Sliding window: 1 = stop-and-wait, up to MAX_WINDOW_SIZE (offered at llopen: the smaller end's is used)
+    LinkLayerArq arq; // Retransmission scheme used when windowSize > 1 (Selective Repeat if both ends have it)
+    LinkLayerCheck check; // I frame check to ask for at llopen (BCC2 if the peer lacks it)
+    LinkLayerFraming framing; // Same, for the encoding of I frame payloads (COBS only with CRC-32C)
+    LinkLayerFec fec; // Same, for forward error correction of I frames (LlFecOff on the receiver refuses it)
+    int chaseCombining; // Receiver: rebuild frames from their failed copies (with CRC-32C only)
+    int ackEvery; // Receiver: one RR per this many frames in sequence (at most half the window)...
+    int ackDelayMs; // ...or this long after the first one not acknowledged; gaps and duplicates at once
+    int adaptiveFrameSize; // Transmitter: size payloads to the error rate seen (see llpayloadSize())
+    int maxPayload; // Largest payload to offer at llopen, up to MAX_LARGE_PAYLOAD_SIZE (the smaller end's is used)
+    LinkLayerCompression compression; // Same as check, for compression of I frame payloads
+    int aggregation; // Same, for packing several packets into one I frame
+    int aggregationDelayMs; // Transmitter: longest a packet is held back for others to join it
+    int simplex; // One-way link: no SET/UA and no acknowledgements; payloads go out once in UI frames
+    int piggyback; // Carry the packets given to llopenWith()/llcloseWith() in SET, UA and DISC, if the peer takes them
+    int outageTimeout; // Transmitter: seconds a line that stopped answering is probed for before giving up (0: no probing)
 } LinkLayer;
 
 // Size of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer.
 #define MAX_PAYLOAD_SIZE 1000
-#define STUFFED_BUFFER_SIZE 1000 * 2 + 20
+
+// Largest payload peers can agree on in SET/UA. Peers that predate the
+// frame size capability get MAX_PAYLOAD_SIZE.
+#define MAX_LARGE_PAYLOAD_SIZE 65535
+#define DEFAULT_MAX_PAYLOAD 4096
+
+// Sliding window.
+// A window of 1 keeps the original 1-bit N(S)/N(R) control fields; larger
+// windows switch to the extended control field with 7-bit sequence numbers.
+// Selective Repeat is limited to half the sequence space.
+#define MAX_WINDOW_SIZE 127
+#define MAX_SR_WINDOW_SIZE 64
+#define DEFAULT_WINDOW_SIZE 7
+#define DEFAULT_ARQ LlSelectiveRepeat
+
+// Frame check, encoding and FEC. FEC, compression and aggregation are
+// optional layers, off unless the caller turns them on (LlFecAdaptive,
+// LlCompressionLz and TRUE are the settings for noisy or slow lines).
+#define DEFAULT_CHECK LlCheckCrc32c
+#define DEFAULT_FRAMING LlFramingStuffing
+#define DEFAULT_FEC LlFecOff
+#define DEFAULT_CHASE_COMBINING TRUE
+#define DEFAULT_ADAPTIVE_FRAME_SIZE TRUE
+#define DEFAULT_COMPRESSION LlCompressionOff
+#define DEFAULT_AGGREGATION FALSE
+#define DEFAULT_AGGREGATION_DELAY_MS 20
+
+// Packets carried in SET and DISC (longer ones go in I frames)
+#define DEFAULT_PIGGYBACK TRUE
+#define MAX_PIGGYBACK_SIZE 255
+
+// A frame that used up its nRetransmissions attempts takes the line as down:
+// the transmitter probes it with SET until the receiver answers, then goes on
+// from the first frame not acknowledged.
+#define DEFAULT_OUTAGE_TIMEOUT 60
+
+// Delayed acknowledgements (windows of 1 acknowledge every frame)
+#define DEFAULT_ACK_EVERY 4
+#define DEFAULT_ACK_DELAY_MS 10
+
+// One-way links (no reverse channel). Both ends must be built alike: with
+// nothing to negotiate over, check, framing and FEC are taken as configured
+// (adaptive FEC stays at its starting level).
+#define DEFAULT_SIMPLEX FALSE
 
 
 // MISC
@@ -33,20 +125,52 @@ typedef struct
 // Return 0 on success or -1 on error.
 int llopen(LinkLayer connectionParameters);
 
-// Send data in buf with size bufSize.
+// Same as llopen() followed by llwrite(packet, packetSize) on the transmitter,
+// without the round trip of an I frame when piggyback is set: the packet goes
+// in the SET. The receiver gets it from its first llread() either way.
+// The receiver's packet (NULL for none) goes in its UA, when it fits there and
+// the transmitter takes it; it is never sent otherwise.
+// Return 0 on success or -1 on error.
+int llopenWith(LinkLayer connectionParameters, const unsigned char *packet, int packetSize);
+
+// Transmitter: copy the packet the receiver gave llopenWith() to packet (room
+// for MAX_PIGGYBACK_SIZE bytes). Returns its size, or 0 if none came.
+int llopenAnswer(unsigned char *packet);
+
+// Largest payload llwrite() takes on this connection, as agreed at llopen.
+int llmaxPayload();
+
+// Payload size that gets the most through the line right now: llmaxPayload(),
+// or less on a noisy line when adaptiveFrameSize is set.
+int llpayloadSize();
+
+// Send data in buf with size bufSize, at most llmaxPayload() (simplex: sent once, not waiting for anything).
+// While the line is down this blocks, for up to outageTimeout seconds.
+// With aggregation, a packet may be held back (Nagle-style) while frames are
+// unacknowledged, for at most aggregationDelayMs or until llclose(), so that
+// later ones share its frame.
 // Return number of chars written, or -1 on error.
 int llwrite(const unsigned char *buf, int bufSize);
 
-// Receive data in packet.
+// Receive data in packet, which needs room for MAX_FRAME_SIZE bytes or
+// llmaxPayload(), whichever is larger.
 // Return number of chars read, or -1 on error.
 int llread(unsigned char *packet);
 
+// Same as llread(), without copying: *packet is set to the payload, which
+// stays valid until the next llread()/llreadView() call.
+// Return number of chars read, or -1 on error.
+int llreadView(const unsigned char **packet);
+
 // Close previously opened connection and print transmission statistics in the console.
 // Return 0 on success or -1 on error.
 int llclose();
 
-// === Timeout handler ===
-void alarmHandler(int signal);
+// Same as llwrite(packet, packetSize) followed by llclose() on the
+// transmitter, the packet going in the DISC when piggyback is set. The
+// receiver gets it from llread() before the DISC.
+// Return 0 on success or -1 on error.
+int llcloseWith(const unsigned char *packet, int packetSize);
 
 
 #endif // _LINK_LAYER_H_
@@ -0,0 +1,132 @@
+// LZ77 compression of frame payloads
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length above 15 as 255s and a final byte below 255.
+// Returns the new output position, or -1 if out of room.
+static int putLength(unsigned char *out, int op, int outMax, int length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        if (op >= outMax) return -1;
+        out[op++] = 255;
+    }
+    if (op >= outMax) return -1;
+    out[op++] = length;
+    return op;
+}
+
+// One sequence: literals, then a match unless matchLength is 0 (the last)
+static int putSequence(unsigned char *out, int op, int outMax, const unsigned char *literals, int literalCount,
+                       int offset, int matchLength)
+{
+    int matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+    if (op >= outMax) return -1;
+    out[op++] = (literalCount < 15 ? literalCount : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+
+    if (literalCount >= 15 && (op = putLength(out, op, outMax, literalCount)) < 0) return -1;
+    if (literalCount > outMax - op) return -1;
+    memcpy(&out[op], literals, literalCount);
+    op += literalCount;
+    if (!matchLength) return op;
+
+    if (op + 2 > outMax) return -1;
+    out[op++] = offset & 0xFF;
+    out[op++] = offset >> 8;
+    if (matchCode >= 15 && (op = putLength(out, op, outMax, matchCode)) < 0) return -1;
+    return op;
+}
+
+int lzCompress(const unsigned char *in, int size, unsigned char *out, int outMax)
+{
+    int table[1 << LZ_HASH_BITS]; // last position + 1 of each hashed 4 bytes
+    memset(table, 0, sizeof(table));
+
+    int op = 0, anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= size)
+    {
+        uint32_t v = read32(&in[i]);
+        int h = hash(v);
+        int candidate = table[h] - 1;
+        table[h] = i + 1;
+
+        if (candidate < 0 || i - candidate > LZ_MAX_OFFSET || read32(&in[candidate]) != v)
+        {
+            i++;
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        while (i + length < size && in[candidate + length] == in[i + length])
+            length++;
+
+        op = putSequence(out, op, outMax, &in[anchor], i - anchor, i - candidate, length);
+        if (op < 0) return -1;
+        i += length;
+        anchor = i;
+    }
+
+    return putSequence(out, op, outMax, &in[anchor], size - anchor, 0, 0);
+}
+
+// Length above 15. Returns the new input position, or -1 past the end.
+static int getLength(const unsigned char *in, int ip, int size, int *length)
+{
+    unsigned char byte;
+    do
+    {
+        if (ip >= size) return -1;
+        byte = in[ip++];
+        *length += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+int lzDecompress(const unsigned char *in, int size, unsigned char *out, int outMax)
+{
+    int ip = 0, op = 0;
+
+    while (ip < size)
+    {
+        int token = in[ip++];
+        int literalCount = token >> 4;
+        if (literalCount == 15 && (ip = getLength(in, ip, size, &literalCount)) < 0) return -1;
+        if (literalCount > size - ip || literalCount > outMax - op) return -1;
+        memcpy(&out[op], &in[ip], literalCount);
+        ip += literalCount;
+        op += literalCount;
+        if (ip == size) break; // the last sequence
+
+        if (ip + 2 > size) return -1;
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int length = token & 15;
+        if (length == 15 && (ip = getLength(in, ip, size, &length)) < 0) return -1;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || length > outMax - op) return -1;
+
+        // Byte by byte: the match may overlap what it copies
+        for (int k = 0; k < length; k++, op++)
+            out[op] = out[op - offset];
+    }
+    return op;
+}
@@ -0,0 +1,20 @@
+// LZ77 compression header.
+
+#ifndef LZ_H
+#define LZ_H
+
+// Compressed blocks are sequences of a token (literal count in the high
+// nibble, match length - 4 in the low one, 15 meaning more length bytes
+// follow, each 255 meaning yet another), the literals, then the offset of
+// the match (2 bytes, least significant first) and its extra length bytes.
+// The last sequence has literals only. This is the LZ4 block layout.
+
+// Compress size bytes of in into out. Returns the compressed size, or -1 if
+// it would take more than outMax bytes.
+int lzCompress(const unsigned char *in, int size, unsigned char *out, int outMax);
+
+// Expand a compressed block of size bytes into out. Returns the expanded
+// size, or -1 if the block is malformed or expands to more than outMax.
+int lzDecompress(const unsigned char *in, int size, unsigned char *out, int outMax);
+
+#endif
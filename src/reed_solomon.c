@@ -0,0 +1,264 @@
+// Reed-Solomon forward error correction, interleaved over a field
+
+#include "reed_solomon.h"
+
+#include <string.h>
+
+#define GF_POLY 0x11D // x^8 + x^4 + x^3 + x^2 + 1
+#define RS_N RS_CODEWORD
+
+////////////////////////////////////////////////
+// GF(2^8)
+////////////////////////////////////////////////
+static unsigned char gfExp[2 * RS_N];
+static unsigned char gfLog[256];
+static unsigned char rootMul[RS_MAX_PARITY][256]; // x * a^i, for the syndromes
+
+// Generators g(x) = (x - a^0)(x - a^1)...(x - a^(parity-1)), highest degree
+// first without the leading 1, built the first time each parity is used
+static unsigned char generators[RS_MAX_PARITY + 1][RS_MAX_PARITY];
+static int generatorBuilt[RS_MAX_PARITY + 1];
+
+static void buildTables()
+{
+    int x = 1;
+    for (int i = 0; i < RS_N; i++)
+    {
+        gfExp[i] = gfExp[i + RS_N] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+
+    for (int i = 0; i < RS_MAX_PARITY; i++)
+    {
+        for (int x = 1; x < 256; x++)
+            rootMul[i][x] = gfExp[gfLog[x] + i];
+    }
+}
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    return (a && b) ? gfExp[gfLog[a] + gfLog[b]] : 0;
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b)
+{
+    return a ? gfExp[gfLog[a] + RS_N - gfLog[b]] : 0;
+}
+
+// a^power, power in 0..RS_N
+static unsigned char gfPow(int power)
+{
+    return gfExp[power % RS_N];
+}
+
+static const unsigned char *generator(int parity)
+{
+    if (gfExp[0] == 0) buildTables();
+    if (generatorBuilt[parity]) return generators[parity];
+
+    // Lowest degree first while multiplying out, then reversed
+    unsigned char g[RS_MAX_PARITY + 1] = {1};
+    for (int i = 0; i < parity; i++)
+    {
+        unsigned char root = gfPow(i);
+        g[i + 1] = 0;
+        for (int j = i + 1; j > 0; j--)
+            g[j] = g[j - 1] ^ gfMul(g[j], root);
+        g[0] = gfMul(g[0], root);
+    }
+    for (int j = 0; j < parity; j++)
+        generators[parity][j] = g[parity - 1 - j];
+
+    generatorBuilt[parity] = 1;
+    return generators[parity];
+}
+
+////////////////////////////////////////////////
+// Codewords
+////////////////////////////////////////////////
+
+// Parity of k data bytes taken stride apart, written stride apart into parity
+static void encodeCodeword(const unsigned char *data, int k, int stride, unsigned char *out, int parity)
+{
+    const unsigned char *g = generator(parity);
+    unsigned char remainder[RS_MAX_PARITY] = {0};
+
+    for (int i = 0; i < k; i++)
+    {
+        unsigned char feedback = data[i * stride] ^ remainder[0];
+        memmove(remainder, &remainder[1], parity - 1);
+        remainder[parity - 1] = 0;
+        if (feedback == 0) continue;
+
+        int logFeedback = gfLog[feedback];
+        for (int j = 0; j < parity; j++)
+        {
+            if (g[j]) remainder[j] ^= gfExp[logFeedback + gfLog[g[j]]];
+        }
+    }
+
+    for (int j = 0; j < parity; j++)
+        out[j * stride] = remainder[j];
+}
+
+// Correct a codeword of n bytes (c[0] is the highest degree) in place.
+// Returns the number of bytes corrected or -1.
+static int decodeCodeword(unsigned char *c, int n, int parity)
+{
+    generator(parity); // tables
+
+    // Syndromes S_i = c(a^i), all of them in one pass over c
+    unsigned char syndromes[RS_MAX_PARITY] = {0};
+    for (int k = 0; k < n; k++)
+    {
+        for (int i = 0; i < parity; i++)
+            syndromes[i] = rootMul[i][syndromes[i]] ^ c[k];
+    }
+
+    int clean = 1;
+    for (int i = 0; i < parity; i++)
+    {
+        if (syndromes[i]) clean = 0;
+    }
+    if (clean) return 0;
+
+    // Berlekamp-Massey: error locator lambda, lowest degree first
+    unsigned char lambda[RS_MAX_PARITY + 1] = {1};
+    unsigned char previous[RS_MAX_PARITY + 1] = {1};
+    int errors = 0;
+    int shift = 1;
+    unsigned char previousDiscrepancy = 1;
+
+    for (int r = 0; r < parity; r++)
+    {
+        unsigned char discrepancy = syndromes[r];
+        for (int i = 1; i <= errors; i++)
+            discrepancy ^= gfMul(lambda[i], syndromes[r - i]);
+
+        if (discrepancy == 0)
+        {
+            shift++;
+            continue;
+        }
+
+        unsigned char saved[RS_MAX_PARITY + 1];
+        memcpy(saved, lambda, sizeof(saved));
+
+        unsigned char scale = gfDiv(discrepancy, previousDiscrepancy);
+        for (int i = 0; i + shift <= parity; i++)
+            lambda[i + shift] ^= gfMul(scale, previous[i]);
+
+        if (2 * errors <= r)
+        {
+            errors = r + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            previousDiscrepancy = discrepancy;
+            shift = 1;
+        }
+        else
+            shift++;
+    }
+    if (2 * errors > parity) return -1;
+
+    // Error evaluator omega = S * lambda mod x^parity
+    unsigned char omega[RS_MAX_PARITY] = {0};
+    for (int i = 0; i < parity; i++)
+    {
+        for (int j = 0; j <= i && j <= errors; j++)
+            omega[i] ^= gfMul(lambda[j], syndromes[i - j]);
+    }
+
+    // Chien search over the positions that exist, Forney for the values
+    int found = 0;
+    for (int k = 0; k < n && found < errors; k++)
+    {
+        int degree = n - 1 - k;
+        int inverse = (RS_N - degree) % RS_N; // log of X^-1
+
+        unsigned char value = 0;
+        for (int i = 0; i <= errors; i++)
+        {
+            if (lambda[i]) value ^= gfExp[gfLog[lambda[i]] + (inverse * i) % RS_N];
+        }
+        if (value) continue;
+
+        // lambda'(X^-1): odd terms only in GF(2^8)
+        unsigned char numerator = 0, derivative = 0;
+        for (int i = 0; i < parity; i++)
+        {
+            if (omega[i]) numerator ^= gfExp[gfLog[omega[i]] + (inverse * i) % RS_N];
+        }
+        for (int i = 1; i <= errors; i += 2)
+        {
+            if (lambda[i]) derivative ^= gfExp[gfLog[lambda[i]] + (inverse * (i - 1)) % RS_N];
+        }
+        if (derivative == 0) return -1;
+
+        // e = X * omega(X^-1) / lambda'(X^-1)
+        c[k] ^= gfMul(gfPow(degree), gfDiv(numerator, derivative));
+        found++;
+    }
+
+    return (found == errors) ? found : -1;
+}
+
+////////////////////////////////////////////////
+// Interleaved fields
+////////////////////////////////////////////////
+int rsEncodedSize(int size, int parity)
+{
+    if (parity == 0) return size;
+
+    int codewords = (size + RS_N - parity - 1) / (RS_N - parity);
+    if (codewords == 0) codewords = 1;
+    return size + codewords * parity;
+}
+
+// Codeword col holds every codewords-th byte from col on; its last parity
+// bytes are parity, which puts all the data first
+static int codewordSize(int encodedSize, int codewords, int col)
+{
+    return (encodedSize - col + codewords - 1) / codewords;
+}
+
+int rsEncode(unsigned char *field, int size, int parity)
+{
+    int encodedSize = rsEncodedSize(size, parity);
+    if (parity == 0) return encodedSize;
+
+    int codewords = (encodedSize + RS_N - 1) / RS_N;
+    for (int col = 0; col < codewords; col++)
+    {
+        int k = codewordSize(encodedSize, codewords, col) - parity;
+        encodeCodeword(&field[col], k, codewords, &field[col + k * codewords], parity);
+    }
+    return encodedSize;
+}
+
+int rsDecode(unsigned char *field, int encodedSize, int parity, int *size)
+{
+    int codewords = (encodedSize + RS_N - 1) / RS_N;
+    *size = encodedSize - codewords * parity;
+    if (parity == 0) return 0;
+    if (*size <= 0) return -1;
+
+    int corrected = 0, failed = 0;
+    for (int col = 0; col < codewords; col++)
+    {
+        unsigned char c[RS_N];
+        int n = codewordSize(encodedSize, codewords, col);
+        for (int k = 0; k < n; k++)
+            c[k] = field[col + k * codewords];
+
+        int fixed = decodeCodeword(c, n, parity);
+        if (fixed < 0) failed = 1;
+        if (fixed <= 0) continue;
+
+        for (int k = 0; k < n; k++)
+            field[col + k * codewords] = c[k];
+        corrected += fixed;
+    }
+    return failed ? -1 : corrected;
+}
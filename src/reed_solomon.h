@@ -0,0 +1,28 @@
+// Reed-Solomon header.
+
+#ifndef REED_SOLOMON_H
+#define REED_SOLOMON_H
+
+// Longest codeword, and most parity bytes in one: RS(255,223) corrects 16
+#define RS_CODEWORD 255
+#define RS_MAX_PARITY 32
+
+// A field of size bytes is split into as few codewords of at most 255 bytes
+// as hold it with parity bytes each (shortened codes over GF(2^8)), byte
+// interleaved: byte j of the field belongs to codeword j % codewords, so a
+// burst of errors is spread over all of them. The field itself is left in
+// place and the parity of every codeword follows it, interleaved the same way.
+
+// Size of a field of size bytes once parity is appended
+int rsEncodedSize(int size, int parity);
+
+// Append the parity of field[0..size) at field[size]; the buffer must hold
+// rsEncodedSize() bytes. Returns the encoded size.
+int rsEncode(unsigned char *field, int size, int parity);
+
+// Correct an encoded field in place and set *size to the size of the field
+// without its parity. Returns the number of bytes corrected, or -1 if some
+// codeword had more errors than parity / 2 (the others are still corrected).
+int rsDecode(unsigned char *field, int encodedSize, int parity, int *size);
+
+#endif
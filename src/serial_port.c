@@ -17,6 +17,15 @@
 int fd = -1;           // File descriptor for open serial port
 struct termios oldtio; // Serial port settings to restore on closing
 
+static SerialPortStats portStats; // System calls made on the port
+
+// Receive buffer: filled by one bulk read() and consumed by the frame
+// parsers without further system calls
+#define RX_BUFFER_SIZE 4096
+static unsigned char rxBuffer[RX_BUFFER_SIZE];
+static int rxHead = 0; // next byte to consume
+static int rxTail = 0; // end of valid data
+
 // Open and configure the serial port.
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate)
@@ -96,6 +105,7 @@ int openSerialPort(const char *serialPort, int baudRate)
         return -1;
     }
 
+    rxHead = rxTail = 0;
     return fd;
 }
 
@@ -113,13 +123,44 @@ int closeSerialPort()
     return close(fd);
 }
 
+// Borrow the received bytes not consumed yet. When there are none, refill
+// the buffer with a single read() of up to RX_BUFFER_SIZE bytes.
+// Returns -1 on error, otherwise the number of bytes available at *bytes.
+int peekSerialPort(const unsigned char **bytes)
+{
+    if (rxHead == rxTail)
+    {
+        portStats.readCalls++;
+        int res = read(fd, rxBuffer, RX_BUFFER_SIZE);
+        if (res < 0) return -1;
+        portStats.bytesRead += res;
+        rxHead = 0;
+        rxTail = res;
+    }
+
+    *bytes = &rxBuffer[rxHead];
+    return rxTail - rxHead;
+}
+
+// Mark the first nBytes returned by peekSerialPort() as consumed.
+void consumeSerialPort(int nBytes)
+{
+    rxHead += nBytes;
+}
+
 // Wait up to 0.1 second (VTIME) for a byte received from the serial port.
 // Must check whether a byte was actually received from the return value.
 // Save the received byte in the "byte" pointer.
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByteSerialPort(unsigned char *byte)
 {
-    return read(fd, byte, 1);
+    const unsigned char *bytes;
+    int res = peekSerialPort(&bytes);
+    if (res <= 0) return res;
+
+    *byte = bytes[0];
+    consumeSerialPort(1);
+    return 1;
 }
 
 // Write up to numBytes from the "bytes" array to the serial port.
@@ -127,5 +168,14 @@ int readByteSerialPort(unsigned char *byte)
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytesSerialPort(const unsigned char *bytes, int nBytes)
 {
-    return write(fd, bytes, nBytes);
+    portStats.writeCalls++;
+    int res = write(fd, bytes, nBytes);
+    if (res > 0) portStats.bytesWritten += res;
+    return res;
+}
+
+// Copy the system call counters into stats.
+void getSerialPortStats(SerialPortStats *stats)
+{
+    *stats = portStats;
 }
@@ -4,6 +4,14 @@
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+typedef struct
+{
+    long readCalls;
+    long writeCalls;
+    long bytesRead;
+    long bytesWritten;
+} SerialPortStats;
+
 // Open and configure the serial port.
 // Returns a positive number if the port was opened successfully or -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
@@ -17,9 +25,20 @@ int closeSerialPort();
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByteSerialPort(unsigned char *byte);
 
+// Get the received bytes that have not been consumed yet, refilling the
+// receive buffer with one bulk read when it is empty.
+// Returns -1 on error, otherwise the number of bytes available at *bytes.
+int peekSerialPort(const unsigned char **bytes);
+
+// Consume nBytes of the bytes returned by peekSerialPort().
+void consumeSerialPort(int nBytes);
+
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytesSerialPort(const unsigned char *bytes, int nBytes);
 
+// Get the number of read()/write() calls made on the port and the bytes they moved.
+void getSerialPortStats(SerialPortStats *stats);
+
 #endif // _SERIAL_PORT_H_
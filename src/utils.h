@@ -21,6 +21,7 @@
 #define C_SET  0x03  // Set up
 #define C_UA   0x07  // Unnumbered Acknowledgment
 #define C_DISC 0x0B  // Disconnect
+#define C_UI   0x13  // Unnumbered information: one-way links, never acknowledged
 
 // Information frames (I frames) with N(S) = 0 or 1
 #define C_I0 0x00  // I frame, sequence number 0
@@ -32,22 +33,99 @@
 #define C_REJ0 0x01
 #define C_REJ1 0x81
 
-// Max frame size
-#define MAX_FRAME_SIZE 2048
+// SREJ with N(r) = 0 or 1: retransmit only frame N(r)
+#define C_SREJ0 0x0D
+#define C_SREJ1 0x8D
+
+// RNR with N(r) = 0 or 1: frames before N(r) received, send no more for now.
+// The transmitter polls with RR (address A_TX) until the receiver answers RR.
+#define C_RNR0 0x09
+#define C_RNR1 0x89
+
+// Extended control field (window > 1): the control byte is followed by a
+// sequence number byte N(S) or N(R) in 0..SEQ_MODULUS_EXT-1, and
+// BCC1 = A ^ C ^ N. Header bytes are stuffed like the data field.
+#define C_IX   0x20
+#define C_RRX  0x25
+#define C_REJX 0x21
+#define C_SREJX 0x2D
+#define C_RNRX 0x29
+#define SEQ_MODULUS_EXT 128
+
+// Capabilities, sent as TLVs (type, length, value) in the information field
+// of SET and UA (followed by BCC2). Peers that send a plain SET get a plain UA.
+#define CAP_CHECK 0x01 // SET: frame checks supported (mask), UA: the one chosen
+#define CHECK_BCC2 0x01
+#define CHECK_CRC32C 0x02
+#define CAP_FRAMING 0x02 // same, for the encoding of I frame information fields
+#define FRAMING_STUFFING 0x01
+#define FRAMING_COBS 0x02
+#define CAP_FEC 0x03 // SET: FEC schemes supported (mask), UA: the one chosen, if any
+#define FEC_RS 0x01
+#define CAP_WINDOW 0x04 // SET: window size and ARQ offered, UA: the ones agreed on (2 bytes)
+#define ARQ_GO_BACK_N 0x00
+#define ARQ_SELECTIVE_REPEAT 0x01
+#define CAP_FRAME_SIZE 0x05 // SET: largest payload taken, UA: the one agreed on (2 bytes, MSB first)
+#define CAP_COMPRESSION 0x06 // SET: payload compressions supported (mask), UA: the one chosen, if any
+#define COMPRESSION_LZ 0x01
+#define CAP_AGGREGATION 0x07 // SET: packet aggregations supported (mask), UA: the one chosen, if any
+#define AGGREGATION_LENGTH_PREFIX 0x01
+#define CAP_FLOW_CONTROL 0x08 // SET: flow controls supported (mask), UA: the one chosen, if any
+#define FLOW_RNR 0x01
+#define CAP_PIGGYBACK 0x09 // SET: where packets are taken (mask), UA: same, and whether the SET's was
+#define PIGGYBACK_SET 0x01
+#define PIGGYBACK_DISC 0x02
+#define CAP_PACKET 0x0A // SET/DISC: a packet for the application (see llopenWith()/llcloseWith())
+#define CAP_RESYNC 0x0B // SET: resynchronisations taken (mask), UA: same
+#define RESYNC_SEQUENCE 0x01
+#define CAP_SEQUENCE 0x0C // resync SET: N(S) of the oldest frame unacknowledged, UA: N(S) expected next
+// A capability the peer leaves out gets what peers without it do: the
+// configured window, MAX_PAYLOAD_SIZE payloads, no compression, one packet
+// per frame, no RNR, packets only in I frames, no resynchronisation.
+
+// Smallest frame buffers (the frame size capability can call for more)
+#define MAX_FRAME_SIZE 4096
 
 // Control Packet 
 #define C_START 1
 #define C_END 3
 #define T_SIZE 0
 #define T_NAME 1
+// START of a resumed transfer: the offset it resumes from (like T_SIZE)
+// and the CRC-32C of the journal chunk hashes below it (4 bytes)
+#define T_OFFSET 2
+#define T_HASH 3
+// END: XXH64 of the whole file (8 bytes, least significant first)
+#define T_FILE_HASH 4
+#define HASH_FIELD_LENGTH 8
+
+// Receiver's answer in its UA: T_DATA_OFFSETS (1 byte) if it takes C_DATA_AT
+// packets and, when it has part of a file, T_SIZE and T_NAME like START plus
+// T_OFFSET for how much of it is on disk and checked against its journal
+#define C_RESUME 5
+#define T_DATA_OFFSETS 5
 
 // Data Packet
 #define C_DATA 2
 
+// Data packet with its place in the file: C_DATA_AT, offset (8 bytes, least
+// significant first), then the size and data like C_DATA
+#define C_DATA_AT 6
+#define DATA_AT_HEADER_SIZE 11
+
+// Fountain symbol packet (one-way links): C_SYMBOL, file size (4 bytes,
+// like T_SIZE), symbol id (4 bytes, same order), then the symbol
+#define C_SYMBOL 4
+#define SYMBOL_HEADER_SIZE 9
+
 // Max data packet size
 #define MAX_DATA_PACKET_SIZE 65535
 
+// Size and offset fields take as few bytes as hold the value, up to
+// MAX_SIZE_FIELD_LENGTH, but never fewer than SIZE_FIELD_LENGTH: receivers
+// that predate 64-bit sizes only read that many
 #define SIZE_FIELD_LENGTH 4
+#define MAX_SIZE_FIELD_LENGTH 8
 
 // === Helper Functions ===
 unsigned char calcBCC1(unsigned char A, unsigned char C);
@@ -0,0 +1,131 @@
+// XXH64, the 64-bit hash of the xxHash family
+
+#include "xxhash.h"
+
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t hash, uint64_t acc)
+{
+    hash ^= round64(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+// Feed whole 32 byte stripes, returning the bytes used
+static size_t consumeStripes(uint64_t *acc, const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        acc[0] = round64(acc[0], read64(&data[i]));
+        acc[1] = round64(acc[1], read64(&data[i + 8]));
+        acc[2] = round64(acc[2], read64(&data[i + 16]));
+        acc[3] = round64(acc[3], read64(&data[i + 24]));
+    }
+    return i;
+}
+
+void xxh64Init(Xxh64 *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->acc[0] = seed + PRIME1 + PRIME2;
+    state->acc[1] = seed + PRIME2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME1;
+}
+
+void xxh64Update(Xxh64 *state, const unsigned char *data, size_t length)
+{
+    state->total += length;
+
+    if (state->bufSize > 0)
+    {
+        size_t take = 32 - state->bufSize;
+        if (take > length) take = length;
+        memcpy(&state->buf[state->bufSize], data, take);
+        state->bufSize += take;
+        data += take;
+        length -= take;
+        if (state->bufSize < 32) return;
+        consumeStripes(state->acc, state->buf, 32);
+        state->bufSize = 0;
+    }
+
+    size_t used = consumeStripes(state->acc, data, length);
+    memcpy(state->buf, &data[used], length - used);
+    state->bufSize = length - used;
+}
+
+uint64_t xxh64Digest(const Xxh64 *state)
+{
+    uint64_t hash;
+    if (state->total >= 32)
+    {
+        const uint64_t *acc = state->acc;
+        hash = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+        for (int i = 0; i < 4; i++) hash = mergeRound(hash, acc[i]);
+    }
+    else
+    {
+        hash = state->seed + PRIME5;
+    }
+    hash += state->total;
+
+    // The tail: 8, then 4, then single bytes
+    const unsigned char *p = state->buf;
+    int left = state->bufSize;
+    for (; left >= 8; p += 8, left -= 8)
+    {
+        hash ^= round64(0, read64(p));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4)
+    {
+        hash ^= read32(p) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+    {
+        hash ^= *p * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -0,0 +1,26 @@
+// XXH64 header.
+
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming XXH64: the same hash of a file whichever pieces it is fed in
+typedef struct
+{
+    uint64_t acc[4];
+    uint64_t total;         // bytes fed so far
+    unsigned char buf[32];  // start of a stripe not fed whole yet
+    int bufSize;
+    uint64_t seed;
+} Xxh64;
+
+void xxh64Init(Xxh64 *state, uint64_t seed);
+
+void xxh64Update(Xxh64 *state, const unsigned char *data, size_t length);
+
+// Hash of everything fed so far (more can still be fed after)
+uint64_t xxh64Digest(const Xxh64 *state);
+
+#endif
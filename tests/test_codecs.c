@@ -0,0 +1,326 @@
+// Codec tests: hashes, framing, compression, FEC, fountain and journal,
+// each checked against reference values or by a round trip
+
+#include "byte_stuffing.h"
+#include "crc32c.h"
+#include "fountain.h"
+#include "journal.h"
+#include "link_layer.h"
+#include "lz.h"
+#include "reed_solomon.h"
+#include "utils.h"
+#include "xxhash.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(condition)                                                          \
+    do                                                                            \
+    {                                                                             \
+        if (!(condition))                                                         \
+        {                                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                           \
+        }                                                                         \
+    } while (0)
+
+// Deterministic test data: random bytes, or bytes that are mostly FLAG and
+// ESC (the worst case for byte stuffing)
+static void fillRandom(unsigned char *data, int size, unsigned seed)
+{
+    for (int i = 0; i < size; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+}
+
+static void fillSpecial(unsigned char *data, int size)
+{
+    for (int i = 0; i < size; i++)
+        data[i] = (i % 3 == 0) ? FLAG : (i % 3 == 1) ? ESC : i;
+}
+
+static uint64_t xxh64Of(const void *data, size_t size)
+{
+    Xxh64 state;
+    xxh64Init(&state, 0);
+    xxh64Update(&state, data, size);
+    return xxh64Digest(&state);
+}
+
+static void testXxh64()
+{
+    CHECK(xxh64Of("", 0) == 0xEF46DB3751D8E999ULL);
+    CHECK(xxh64Of("a", 1) == 0xD24EC4F1A98C6E5BULL);
+    CHECK(xxh64Of("abc", 3) == 0x44BC2CF5AD770999ULL);
+    const char *text = "Nobody inspects the spammish repetition";
+    CHECK(xxh64Of(text, strlen(text)) == 0xFBCEA83C8A378BF1ULL);
+
+    // Fed in pieces of every size, across stripe boundaries
+    static unsigned char data[100000];
+    fillRandom(data, sizeof(data), 1);
+    Xxh64 state;
+    xxh64Init(&state, 0);
+    for (int i = 0, n = 1; i < (int)sizeof(data); i += n, n = n % 97 + 1)
+        xxh64Update(&state, &data[i], (i + n > (int)sizeof(data)) ? sizeof(data) - i : n);
+    CHECK(xxh64Digest(&state) == xxh64Of(data, sizeof(data)));
+}
+
+static void testCrc32c()
+{
+    CHECK(crc32c(0, (const unsigned char *)"123456789", 9) == 0xE3069283);
+
+    static unsigned char data[10000];
+    fillRandom(data, sizeof(data), 2);
+    uint32_t crc = 0;
+    for (int i = 0; i < (int)sizeof(data); i += 333)
+        crc = crc32c(crc, &data[i], (i + 333 > (int)sizeof(data)) ? sizeof(data) - i : 333);
+    CHECK(crc == crc32c(0, data, sizeof(data)));
+}
+
+// Encode with stuffing or COBS, check no FLAG is left, then decode it back
+static void testFraming(int cobs, const unsigned char *data, int size)
+{
+    static unsigned char encoded[2 * 8192 + 64], decoded[8192];
+    unsigned char bcc2 = 0, expected = 0;
+    for (int i = 0; i < size; i++) expected ^= data[i];
+
+    int encodedSize;
+    if (cobs)
+    {
+        CobsEncoder encoder;
+        cobsBegin(&encoder, encoded, sizeof(encoded));
+        CHECK(cobsPut(&encoder, data, size) == 0);
+        encodedSize = cobsEnd(&encoder);
+    }
+    else
+    {
+        encodedSize = bytestuffingBCC2(data, size, encoded, sizeof(encoded), &bcc2);
+        CHECK(bcc2 == expected);
+    }
+    CHECK(encodedSize >= size);
+    CHECK(memchr(encoded, FLAG, encodedSize) == NULL);
+
+    // In two pieces, as the parser gets them from the port
+    DestuffState state = {0};
+    int decodedSize = 0;
+    int half = encodedSize / 2;
+    int used = cobs ? cobsDecodeBCC2(encoded, half, decoded, &decodedSize, sizeof(decoded), &state)
+                    : destuffBCC2(encoded, half, decoded, &decodedSize, sizeof(decoded), &state);
+    used += cobs ? cobsDecodeBCC2(&encoded[half], encodedSize - half, decoded, &decodedSize, sizeof(decoded), &state)
+                 : destuffBCC2(&encoded[half], encodedSize - half, decoded, &decodedSize, sizeof(decoded), &state);
+    CHECK(used == encodedSize);
+    CHECK(!state.malformed);
+    CHECK(decodedSize == size && memcmp(decoded, data, size) == 0);
+    CHECK(state.bcc == expected);
+}
+
+static void testStuffingAndCobs()
+{
+    static unsigned char data[8192];
+    int sizes[] = {1, 31, 32, 33, 254, 255, 1000, 8192};
+
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        fillRandom(data, sizes[i], i);
+        testFraming(FALSE, data, sizes[i]);
+        testFraming(TRUE, data, sizes[i]);
+        fillSpecial(data, sizes[i]);
+        testFraming(FALSE, data, sizes[i]);
+        testFraming(TRUE, data, sizes[i]);
+    }
+
+    // All FLAG and ESC: every byte takes two
+    unsigned char bcc2 = 0, out[8];
+    unsigned char special[] = {FLAG, ESC};
+    CHECK(bytestuffingBCC2(special, 2, out, sizeof(out), &bcc2) == 4);
+    CHECK(out[0] == ESC && out[1] == ESCAUX && out[2] == ESC && out[3] == ESCAUX2);
+    CHECK(bytestuffingBCC2(special, 2, out, 3, &bcc2) == -1);
+}
+
+static void testLz()
+{
+    static unsigned char data[20000], packed[25000], unpacked[20000];
+
+    // Text repeats, random data does not (and must still come back)
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = "the quick brown fox "[i % 20] + (i / 1000) % 3;
+    int size = lzCompress(data, sizeof(data), packed, sizeof(packed));
+    CHECK(size > 0 && size < (int)sizeof(data) / 4);
+    CHECK(lzDecompress(packed, size, unpacked, sizeof(unpacked)) == (int)sizeof(data));
+    CHECK(memcmp(data, unpacked, sizeof(data)) == 0);
+
+    fillRandom(data, sizeof(data), 3);
+    size = lzCompress(data, sizeof(data), packed, sizeof(packed));
+    CHECK(size > 0);
+    CHECK(lzDecompress(packed, size, unpacked, sizeof(unpacked)) == (int)sizeof(data));
+    CHECK(memcmp(data, unpacked, sizeof(data)) == 0);
+
+    // Too small an output is an error either way, not an overrun
+    CHECK(lzCompress(data, sizeof(data), packed, 100) == -1);
+    CHECK(lzDecompress(packed, size, unpacked, 100) == -1);
+}
+
+static void testReedSolomon()
+{
+    static unsigned char field[2000 + 16 * RS_MAX_PARITY], original[2000];
+    int parities[] = {2, 8, 16, 32};
+
+    for (int p = 0; p < (int)(sizeof(parities) / sizeof(parities[0])); p++)
+    {
+        int parity = parities[p];
+        int size = 2000;
+        fillRandom(original, size, 4 + p);
+        memcpy(field, original, size);
+        int encodedSize = rsEncode(field, size, parity);
+        CHECK(encodedSize == rsEncodedSize(size, parity));
+        int codewords = (encodedSize - size) / parity;
+
+        // A burst of parity / 2 errors in each codeword (interleaved, so
+        // one stretch of consecutive bytes), parity included
+        int burst = codewords * (parity / 2);
+        for (int i = 0; i < burst; i++) field[encodedSize - burst - 7 + i] ^= 0xA5;
+        int decodedSize = 0;
+        CHECK(rsDecode(field, encodedSize, parity, &decodedSize) == burst);
+        CHECK(decodedSize == size && memcmp(field, original, size) == 0);
+
+        // No errors: nothing to correct
+        CHECK(rsDecode(field, encodedSize, parity, &decodedSize) == 0);
+    }
+}
+
+static void testFountain()
+{
+    int symbolSize = 100;
+    long size = 25000;
+    int k = fountainSymbolCount(size, symbolSize);
+    unsigned char *source = calloc(k, symbolSize);
+    unsigned char *symbol = malloc(symbolSize);
+    fillRandom(source, size, 5);
+
+    Fountain encoder, decoder;
+    CHECK(fountainInit(&encoder, k, symbolSize, FALSE) == 0);
+    CHECK(fountainInit(&decoder, k, symbolSize, TRUE) == 0);
+
+    // One symbol in three lost on the way
+    int done = FALSE;
+    uint32_t id;
+    for (id = 0; !done && id < (uint32_t)(3 * k); id++)
+    {
+        if (id % 3 == 2) continue;
+        fountainEncode(&encoder, source, id, symbol);
+        done = fountainDecode(&decoder, id, symbol);
+    }
+    CHECK(done);
+    CHECK(decoder.received < k + k / 2 + 20);
+    for (int i = 0; done && i < k; i++)
+        CHECK(memcmp(fountainSource(&decoder, i), &source[i * symbolSize], symbolSize) == 0);
+
+    fountainFree(&encoder);
+    fountainFree(&decoder);
+    free(source);
+    free(symbol);
+}
+
+static void truncateFile(const char *path, long by)
+{
+    int fd = open(path, O_RDWR);
+    off_t size = lseek(fd, 0, SEEK_END);
+    CHECK(ftruncate(fd, size - by) == 0);
+    close(fd);
+}
+
+static void testJournal()
+{
+    char dir[] = "/tmp/test_journal_XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char dataPath[64], journalPath[64];
+    snprintf(dataPath, sizeof(dataPath), "%s/file", dir);
+    snprintf(journalPath, sizeof(journalPath), "%s/file.journal", dir);
+
+    long size = 3 * JOURNAL_CHUNK_SIZE + JOURNAL_CHUNK_SIZE / 2;
+    unsigned char *data = malloc(size);
+    fillRandom(data, size, 6);
+    int fd = open(dataPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    // Three chunks and a bit written, in pieces that straddle chunks
+    Journal journal;
+    CHECK(journalOpen(&journal, journalPath) == 0);
+    CHECK(!journalMatches(&journal, "file", size));
+    CHECK(journalStart(&journal, "file", size, 0) == 0);
+    long written = 0;
+    while (written < 3 * JOURNAL_CHUNK_SIZE + 100)
+    {
+        int n = 5000;
+        CHECK(write(fd, &data[written], n) == n);
+        CHECK(journalAdd(&journal, &data[written], n, fd) == 0);
+        written += n;
+    }
+    journalClose(&journal, FALSE);
+
+    // Only whole chunks count, and they match the file
+    CHECK(journalOpen(&journal, journalPath) == 0);
+    CHECK(journalMatches(&journal, "file", size));
+    CHECK(!journalMatches(&journal, "file", size + 1));
+    CHECK(journal.offset == 3 * JOURNAL_CHUNK_SIZE);
+    CHECK(journalVerify(&journal, fd) == 3 * JOURNAL_CHUNK_SIZE);
+    uint32_t hash;
+    CHECK(journalFileHash(fd, 2 * JOURNAL_CHUNK_SIZE, &hash) == 0);
+    CHECK(hash == journalPrefixHash(&journal, 2 * JOURNAL_CHUNK_SIZE));
+    CHECK(journalFileHash(fd, size, &hash) == -1); // not all written yet
+    journalClose(&journal, FALSE);
+
+    // A record cut short by a crash is dropped, the ones before it kept
+    truncateFile(journalPath, 3);
+    CHECK(journalOpen(&journal, journalPath) == 0);
+    CHECK(journal.offset == 2 * JOURNAL_CHUNK_SIZE);
+    journalClose(&journal, FALSE);
+
+    // A chunk changed on disk is no longer vouched for, nor what follows
+    CHECK(journalOpen(&journal, journalPath) == 0);
+    unsigned char byte = data[JOURNAL_CHUNK_SIZE + 10] ^ 1;
+    CHECK(pwrite(fd, &byte, 1, JOURNAL_CHUNK_SIZE + 10) == 1);
+    CHECK(journalVerify(&journal, fd) == JOURNAL_CHUNK_SIZE);
+
+    // Resumed from there to the end: the short last chunk closes it
+    CHECK(journalStart(&journal, "file", size, JOURNAL_CHUNK_SIZE) == 0);
+    CHECK(pwrite(fd, &data[JOURNAL_CHUNK_SIZE], size - JOURNAL_CHUNK_SIZE, JOURNAL_CHUNK_SIZE) == size - JOURNAL_CHUNK_SIZE);
+    CHECK(journalAdd(&journal, &data[JOURNAL_CHUNK_SIZE], size - JOURNAL_CHUNK_SIZE, fd) == 0);
+    CHECK(journal.offset == size);
+    CHECK(journalAdd(&journal, data, 1, fd) == -1); // past the end
+    journalClose(&journal, FALSE);
+    CHECK(journalOpen(&journal, journalPath) == 0);
+    CHECK(journalVerify(&journal, fd) == size);
+    CHECK(journalFileHash(fd, size, &hash) == 0 && hash == journalPrefixHash(&journal, size));
+    journalClose(&journal, TRUE);
+    CHECK(access(journalPath, F_OK) != 0);
+
+    close(fd);
+    unlink(dataPath);
+    rmdir(dir);
+    free(data);
+}
+
+int main()
+{
+    testXxh64();
+    testCrc32c();
+    testStuffingAndCobs();
+    testLz();
+    testReedSolomon();
+    testFountain();
+    testJournal();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "test_codecs: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_codecs: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,303 @@
+// Link tests: transfers over a pair of ptys bridged by a process that
+// damages the line. One corrupts a byte now and then, checking that llwrite()
+// allocates nothing and encodes each frame once (its one copy of the
+// payload), retransmissions going out of the window slot it was encoded
+// into. The other loses the last I frame, which only its timer can recover.
+
+#define _GNU_SOURCE // posix_openpt() and cfmakeraw()
+
+#include "link_layer.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define PACKETS 200
+#define PACKET_SIZE 1000
+#define CORRUPT_EVERY 15013 // bytes from the transmitter to the receiver
+
+// Lost frame: the last of a window of 7 (Ns 19), with nothing after it
+#define LOSS_PACKETS 20
+
+#define TIME_LIMIT 30 // seconds for a whole transfer, llclose() included
+
+static int failures = 0;
+
+#define CHECK(condition)                                                          \
+    do                                                                            \
+    {                                                                             \
+        if (!(condition))                                                         \
+        {                                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                           \
+        }                                                                         \
+    } while (0)
+
+////////////////////////////////////////////////
+// Counters (the Makefile links with --wrap)
+////////////////////////////////////////////////
+
+static int counting = FALSE;
+static long allocations = 0;
+static long encodings = 0;
+static long encodedIn = 0;  // payload bytes given to the stuffing pass
+static long encodedOut = 0; // and what came out of it
+static long bytesWritten = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_bytestuffingBCC2(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2);
+int __real_writeBytesSerialPort(const unsigned char *bytes, int nBytes);
+
+void *__wrap_malloc(size_t size)
+{
+    if (counting) allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    if (counting) allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (counting) allocations++;
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_bytestuffingBCC2(const unsigned char *data, size_t length, unsigned char *out, int outMax, unsigned char *bcc2)
+{
+    int size = __real_bytestuffingBCC2(data, length, out, outMax, bcc2);
+    if (counting)
+    {
+        encodings++;
+        encodedIn += length;
+        encodedOut += size;
+    }
+    return size;
+}
+
+int __wrap_writeBytesSerialPort(const unsigned char *bytes, int nBytes)
+{
+    int res = __real_writeBytesSerialPort(bytes, nBytes);
+    if (counting && res > 0) bytesWritten += res;
+    return res;
+}
+
+////////////////////////////////////////////////
+// Line
+////////////////////////////////////////////////
+
+// A pty whose slave is set raw and kept open, so that nothing is echoed or
+// translated before the link layer opens it. Returns the master or -1.
+static int openPty(char *slaveName, int *slaveFd)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) return -1;
+    strcpy(slaveName, ptsname(master));
+
+    *slaveFd = open(slaveName, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (*slaveFd < 0 || tcgetattr(*slaveFd, &tio) < 0) return -1;
+    cfmakeraw(&tio);
+    if (tcsetattr(*slaveFd, TCSANOW, &tio) < 0) return -1;
+    return master;
+}
+
+// Copy between the two masters a frame at a time (FLAG to FLAG), flipping a
+// bit every corruptEvery bytes (0: never) on the way to the receiver and
+// dropping the dropFrame-th I frame sent (0: none)
+static void bridge(int txMaster, int rxMaster, long corruptEvery, int dropFrame)
+{
+    struct pollfd pfds[2] = {{.fd = txMaster, .events = POLLIN}, {.fd = rxMaster, .events = POLLIN}};
+    static unsigned char buf[4096], frame[2 * MAX_FRAME_SIZE];
+    int frameSize = 0;
+    int iFrames = 0;
+    long forwarded = 0;
+
+    while (poll(pfds, 2, -1) > 0)
+    {
+        if (pfds[1].revents & POLLIN)
+        {
+            int n = read(rxMaster, buf, sizeof(buf));
+            if (n > 0 && write(txMaster, buf, n) != n) return;
+        }
+        if (!(pfds[0].revents & POLLIN)) continue;
+
+        int n = read(txMaster, buf, sizeof(buf));
+        for (int i = 0; i < n; i++)
+        {
+            unsigned char byte = buf[i];
+            if (corruptEvery > 0 && ++forwarded % corruptEvery == 0) byte ^= 0x10;
+            if (frameSize < (int)sizeof(frame)) frame[frameSize++] = byte;
+            if (byte != FLAG || frameSize == 1) continue;
+
+            // Only I frames carry a payload
+            int drop = (frameSize > PACKET_SIZE / 2 && ++iFrames == dropFrame);
+            if (!drop && write(rxMaster, frame, frameSize) != frameSize) return;
+            frameSize = 0;
+        }
+    }
+}
+
+static void fillPacket(unsigned char *packet, int n)
+{
+    for (int i = 0; i < PACKET_SIZE; i++) packet[i] = (n * 31 + i * 7) ^ (i >> 3);
+}
+
+static LinkLayer parameters(const char *port, LinkLayerRole role)
+{
+    // What is left out is off (FEC, compression, aggregation and so on)
+    LinkLayer connection = {
+        .role = role,
+        .baudRate = 115200,
+        .nRetransmissions = 10,
+        .timeout = 1,
+        .windowSize = DEFAULT_WINDOW_SIZE,
+        .arq = LlSelectiveRepeat,
+        .check = LlCheckCrc32c,
+        .ackEvery = DEFAULT_ACK_EVERY,
+        .ackDelayMs = DEFAULT_ACK_DELAY_MS,
+        .maxPayload = PACKET_SIZE,
+        .outageTimeout = 10,
+    };
+    strcpy(connection.serialPort, port);
+    return connection;
+}
+
+// Read every packet and check it. Exits 0 if they all came in order.
+static int receiver(const char *port, int packets)
+{
+    static unsigned char packet[MAX_FRAME_SIZE], expected[PACKET_SIZE];
+    if (llopen(parameters(port, LlRx)) < 0) return 1;
+
+    int bad = 0;
+    for (int n = 0; n < packets; n++)
+    {
+        int size = llread(packet);
+        fillPacket(expected, n);
+        if (size != PACKET_SIZE || memcmp(packet, expected, PACKET_SIZE) != 0) bad++;
+        if (size < 0) break;
+    }
+    llclose();
+    return bad > 0;
+}
+
+static pid_t bridgePid = -1, rxPid = -1;
+
+static void timeLimitReached(int signal)
+{
+    static const char message[] = "test_link: transfer did not finish in time\n";
+    kill(bridgePid, SIGKILL);
+    kill(rxPid, SIGKILL);
+    if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) _exit(1);
+    _exit(1);
+}
+
+// Send packets over a damaged line, counting what llwrite() does on the way.
+// Returns the number of packets written, with llclose() and the receiver's
+// result in *closed and *received (TRUE if all went well).
+static int transfer(int packets, long corruptEvery, int dropFrame, int *closed, int *received)
+{
+    char txPort[64], rxPort[64];
+    int txMaster, rxMaster, txSlave, rxSlave;
+    *closed = *received = FALSE;
+    if ((txMaster = openPty(txPort, &txSlave)) < 0 || (rxMaster = openPty(rxPort, &rxSlave)) < 0)
+    {
+        perror("pty");
+        return 0;
+    }
+
+    bridgePid = fork();
+    if (bridgePid == 0)
+    {
+        bridge(txMaster, rxMaster, corruptEvery, dropFrame);
+        _exit(0);
+    }
+    close(txMaster);
+    close(rxMaster);
+
+    rxPid = fork();
+    if (rxPid == 0) _exit(receiver(rxPort, packets));
+    alarm(TIME_LIMIT);
+
+    static unsigned char packet[PACKET_SIZE];
+    int opened = llopen(parameters(txPort, LlTx)) == 0;
+    CHECK(opened);
+
+    int written = 0;
+    counting = TRUE;
+    for (int n = 0; opened && n < packets; n++)
+    {
+        fillPacket(packet, n);
+        written += llwrite(packet, PACKET_SIZE) == PACKET_SIZE;
+    }
+    counting = FALSE;
+    if (opened) *closed = (llclose() == 0);
+    alarm(0);
+
+    int status = 1;
+    waitpid(rxPid, &status, 0);
+    *received = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    kill(bridgePid, SIGTERM);
+    waitpid(bridgePid, NULL, 0);
+    close(txSlave);
+    close(rxSlave);
+    return written;
+}
+
+int main()
+{
+    // The link layer reports on stdout: only the results go to stderr
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    signal(SIGALRM, timeLimitReached);
+
+    int closed, received;
+    int written = transfer(PACKETS, CORRUPT_EVERY, 0, &closed, &received);
+
+    fprintf(stderr, "test_link: %d frames, %.2f allocations and %.2f encodings per frame, "
+                    "%.2f payload bytes copied per payload byte, %.2f bytes written per byte encoded\n",
+            written, (double)allocations / PACKETS, (double)encodings / PACKETS,
+            (double)encodedIn / (PACKETS * PACKET_SIZE), (double)bytesWritten / (encodedOut ? encodedOut : 1));
+
+    CHECK(written == PACKETS);
+    CHECK(closed);
+    CHECK(received);
+    CHECK(allocations == 0);
+    CHECK(encodings == PACKETS);
+    CHECK(encodedIn == PACKETS * PACKET_SIZE);
+
+    // Frames were lost to the bridge and sent again, without being encoded
+    // again: the line carried more than one pass of the frame headers and
+    // trailers (under 24 bytes each) could account for
+    CHECK(bytesWritten > encodedOut + 24L * PACKETS);
+
+    // The last frame lost and nothing after it to give that away: only its
+    // own timer brings it back, before llclose() can finish
+    time_t start = time(NULL);
+    written = transfer(LOSS_PACKETS, 0, LOSS_PACKETS, &closed, &received);
+
+    fprintf(stderr, "test_link: last of %d frames lost, transfer closed after %ld s\n", written, (long)(time(NULL) - start));
+    CHECK(written == LOSS_PACKETS);
+    CHECK(closed);
+    CHECK(received);
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "test_link: %d check(s) failed\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "test_link: all checks passed\n");
+    return 0;
+}